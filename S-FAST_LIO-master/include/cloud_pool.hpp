@@ -0,0 +1,49 @@
+#ifndef CLOUD_POOL_HPP
+#define CLOUD_POOL_HPP
+
+#include <vector>
+
+#include "common_lib.h"
+
+//单帧点云的缓冲池：预处理的输出从池中取，之后只传递指针(预处理->去畸变)，不再整帧拷贝
+//池中的点云只被池本身持有时(use_count()==1)才会再次取出，点的内存在帧之间复用，稳定后每帧不再分配内存
+//不加锁，只能在一个线程中acquire(laserMapping中是持有mtx_buffer的雷达回调)
+class cloud_pool
+{
+public:
+	struct stats
+	{
+		size_t clouds = 0; //新建的点云个数
+		size_t grows = 0;  //收回的点云capacity超过以往最大值的次数，即流水线中有点的内存因放不下而重新分配
+	};
+
+	PointCloudXYZI::Ptr acquire()
+	{
+		for (PointCloudXYZI::Ptr &cloud : pool_)
+		{
+			if (cloud.use_count() != 1)
+				continue;
+			//点的内存会在预处理/排序的缓冲之间交换，只有超过以往最大的capacity才一定是新分配的
+			if (cloud->points.capacity() > max_capacity_)
+			{
+				max_capacity_ = cloud->points.capacity();
+				st_.grows++;
+			}
+			cloud->clear();
+			return cloud;
+		}
+		st_.clouds++;
+		pool_.push_back(PointCloudXYZI::Ptr(new PointCloudXYZI()));
+		return pool_.back();
+	}
+
+	size_t size() const { return pool_.size(); }
+	const stats &get_stats() const { return st_; }
+
+private:
+	vector<PointCloudXYZI::Ptr> pool_;
+	size_t max_capacity_ = 0;
+	stats st_;
+};
+
+#endif
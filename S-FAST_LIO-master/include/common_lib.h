@@ -9,6 +9,7 @@
 #include <nav_msgs/Odometry.h>
 #include <tf/transform_broadcaster.h>
 #include <eigen_conversions/eigen_msg.h>
+#include <ikd-Tree/ikd_Tree.h>
 
 using namespace std;
 using namespace Eigen;
@@ -16,6 +17,7 @@ using namespace Eigen;
 #define PI_M (3.14159265358)
 #define G_m_s2 (9.81)               // Gravaty const in GuangDong/China
 #define NUM_MATCH_POINTS    (5)     
+#define MATCH_MAX_SQ_DIST   (5.0f)  // a match is rejected when its k-th neighbour is farther than this (squared)
 
 #define VEC_FROM_ARRAY(v)        v[0],v[1],v[2]
 #define MAT_FROM_ARRAY(v)        v[0],v[1],v[2],v[3],v[4],v[5],v[6],v[7],v[8]
@@ -26,6 +28,8 @@ typedef sfast_lio::Pose6D Pose6D;
 typedef pcl::PointXYZINormal PointType;
 typedef pcl::PointCloud<PointType> PointCloudXYZI;
 typedef vector<PointType, Eigen::aligned_allocator<PointType>>  PointVector;
+typedef ikdTree_PointType MapPointType;     // points stored in the map, only xyz + intensity
+typedef vector<MapPointType, Eigen::aligned_allocator<MapPointType>>  MapPointVector;
 typedef Vector3d V3D;
 typedef Matrix3d M3D;
 typedef Vector3f V3F;
@@ -41,10 +45,12 @@ struct MeasureGroup     // Lidar data and imu dates for the current process
     MeasureGroup()
     {
         lidar_beg_time = 0.0;
+        lidar_time_ordered = false;
         this->lidar.reset(new PointCloudXYZI());
     };
     double lidar_beg_time;
     double lidar_end_time;
+    bool lidar_time_ordered;    // lidar points already sorted by curvature (time) in preprocess
     PointCloudXYZI::Ptr lidar;
     deque<sensor_msgs::Imu::ConstPtr> imu;
 };
@@ -67,13 +73,34 @@ auto set_pose6d(const double t, const Matrix<T, 3, 1> &a, const Matrix<T, 3, 1>
 }
 
 
-float calc_dist(PointType p1, PointType p2){
+template<typename P1, typename P2>
+float calc_dist(const P1 &p1, const P2 &p2){
     float d = (p1.x - p2.x) * (p1.x - p2.x) + (p1.y - p2.y) * (p1.y - p2.y) + (p1.z - p2.z) * (p1.z - p2.z);
     return d;
 }
 
-template<typename T>
-bool esti_plane(Matrix<T, 4, 1> &pca_result, const PointVector &point, const T &threshold)
+MapPointType to_map_point(const PointType &p)
+{
+    MapPointType q;
+    q.x = p.x;
+    q.y = p.y;
+    q.z = p.z;
+    q.intensity = p.intensity;
+    return q;
+}
+
+PointType from_map_point(const MapPointType &p)
+{
+    PointType q;
+    q.x = p.x;
+    q.y = p.y;
+    q.z = p.z;
+    q.intensity = p.intensity;
+    return q;
+}
+
+template<typename T, typename Points>
+bool esti_plane(Matrix<T, 4, 1> &pca_result, const Points &point, const T &threshold)
 {
     Matrix<T, NUM_MATCH_POINTS, 3> A;
     Matrix<T, NUM_MATCH_POINTS, 1> b;
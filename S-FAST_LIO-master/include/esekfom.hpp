@@ -9,8 +9,11 @@
 #include <Eigen/Dense>
 #include <Eigen/Sparse>
 
+#include <omp.h>
+
 #include "use-ikfom.hpp"
-#include <ikd-Tree/ikd_Tree.h>
+#include "plane_cache.hpp"
+#include "local_map.hpp"
 
 //该hpp主要包含：广义加减法，前向传播主函数，计算特征点残差及其雅可比，ESKF主函数
 
@@ -20,25 +23,90 @@ namespace esekfom
 {
 	using namespace Eigen;
 
-	PointCloudXYZI::Ptr normvec(new PointCloudXYZI(100000, 1));		  //特征点在地图中对应的平面参数(平面的单位法向量,以及当前点到平面距离)
-	PointCloudXYZI::Ptr laserCloudOri(new PointCloudXYZI(100000, 1)); //有效特征点
-	PointCloudXYZI::Ptr corr_normvect(new PointCloudXYZI(100000, 1)); //有效特征点对应点法相量
-	bool point_selected_surf[100000] = {1};							  //判断是否是有效特征点
+	//每个特征点的残差工作区(SoA布局)，由esekf持有，大小随输入点云增长
+	struct residual_workspace
+	{
+		vector<float> norm_x, norm_y, norm_z; //特征点在地图中对应平面的单位法向量
+		vector<float> pd2;					  //当前点到平面距离
+		vector<char> valid;					  //判断是否是有效特征点(不用vector<bool>, 以便多线程按下标并行写入)
+
+		//近邻复用: 上一次搜索近邻时点的世界坐标，以及近邻和平面拟合的结果
+		vector<float> search_x, search_y, search_z;
+		vector<float> plane_d;		  //拟合平面 ax+by+cz+d=0 的d (a,b,c存放在norm_x/y/z中)
+		vector<char> searched;		  //本帧中是否已经搜索过近邻
+		vector<char> nn_valid;		  //近邻数量和距离是否满足要求
+		vector<char> plane_valid;	  //平面拟合是否成功
+
+		//批量近邻搜索: 需要重新搜索的点及其在搜索结果中的位置(-1表示本次不搜索)
+		MapPointVector queries;
+		vector<int> batch_slot;
+		local_map::batch_result batch;
+
+		void resize(int n)
+		{
+			if (int(valid.size()) >= n)
+				return;
+			norm_x.resize(n);
+			norm_y.resize(n);
+			norm_z.resize(n);
+			pd2.resize(n);
+			valid.resize(n, 0);
+			search_x.resize(n);
+			search_y.resize(n);
+			search_z.resize(n);
+			plane_d.resize(n);
+			searched.resize(n, 0);
+			nn_valid.resize(n, 0);
+			plane_valid.resize(n, 0);
+			batch_slot.resize(n, -1);
+		}
+
+		//新的一帧点云，之前的近邻都作废
+		void reset_search(int n)
+		{
+			std::fill(searched.begin(), searched.begin() + n, 0);
+		}
+	};
+
+	//每帧的近邻搜索统计
+	struct search_stats
+	{
+		int searched = 0;	//实际执行的近邻搜索次数
+		int skipped = 0;	//需要重新搜索时，因位移小于阈值而复用上次近邻的次数
+		int rejected = 0;	//搜索中途即可确定匹配距离内不足k个近邻而提前放弃的次数
+		int iterations = 0; //ESKF实际迭代次数
+		int plane_hits = 0;		  //平面缓存命中次数
+		int plane_misses = 0;	  //平面缓存未命中、重新拟合平面的次数
+		double plane_fit_time = 0; //未命中时拟合平面的总耗时(s)
+	};
+
+	template <int H_DIM = 12>
 	struct dyn_share_datastruct
 	{
 		bool valid;												   //有效特征点数量是否满足要求
 		bool converge;											   //迭代时，是否已经收敛
 		Eigen::Matrix<double, Eigen::Dynamic, 1> h;				   //残差	(公式(14)中的z)
 		Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> h_x; //雅可比矩阵H (公式(14)中的H)
+		Eigen::Matrix<double, H_DIM, H_DIM> HTH;				   //信息形式: H^T * H 的非零块 (不构造H本身)
+		Eigen::Matrix<double, H_DIM, 1> HTz;					   //信息形式: H^T * z
+		int effct_feat_num;										   //有效特征点数量
 	};
 
-	class esekf
+	//L为误差状态布局(见use-ikfom.hpp中的state_layout)，外参固定时可用18维/15维的布局，得到固定尺寸的更小的矩阵运算
+	template <typename L = state_layout_t>
+	class esekf_
 	{
 	public:
-		typedef Matrix<double, 24, 24> cov;				// 24X24的协方差矩阵
-		typedef Matrix<double, 24, 1> vectorized_state; // 24X1的向量
-		esekf(){};
-		~esekf(){};
+		enum
+		{
+			DIM = L::DIM,	 //误差状态维数
+			H_DIM = L::H_DIM //雅可比H的非零列数
+		};
+		typedef Matrix<double, DIM, DIM> cov;			 // DIMXDIM的协方差矩阵
+		typedef Matrix<double, DIM, 1> vectorized_state; // DIMX1的向量
+		typedef dyn_share_datastruct<H_DIM> dyn_share_t;
+		esekf_(){};
+		~esekf_(){};
 
 		state_ikfom get_x()
 		{
@@ -47,6 +115,7 @@ namespace esekfom
 
 		cov get_P()
 		{
+			flush_predict();
 			return P_;
 		}
 
@@ -58,110 +127,362 @@ namespace esekfom
 		void change_P(cov &input_cov)
 		{
 			P_ = input_cov;
+			batch_steps_ = 0;
+		}
+
+		//是否使用信息形式的更新(逐点累加H^T*H和H^T*z，不构造m X 12的雅可比矩阵)
+		void set_info_form_update(bool en)
+		{
+			info_form_update_ = en;
+		}
+
+		//近邻复用: 点的世界坐标相对上一次搜索时的位移小于 reuse_ratio * map_voxel 时不重新搜索近邻 (reuse_ratio<=0 时每次都搜索)
+		//迭代提前结束: 状态增量的每一维都小于 stop_epsi 时立即结束迭代 (stop_epsi<=0 时不提前结束)
+		void set_search_reuse(double map_voxel, double reuse_ratio, double stop_epsi)
+		{
+			reuse_dist_ = reuse_ratio > 0 ? float(map_voxel * reuse_ratio) : -1.f;
+			stop_epsi_ = stop_epsi;
+		}
+
+		//按地图体素缓存拟合的平面 (nullptr时不使用缓存)
+		void set_plane_cache(plane_cache *cache)
+		{
+			plane_cache_ = cache;
+		}
+
+		const search_stats &get_search_stats() const
+		{
+			return stats_;
 		}
 
 		//广义加法  公式(4)
-		state_ikfom boxplus(state_ikfom x, Eigen::Matrix<double, 24, 1> f_)
+		state_ikfom boxplus(state_ikfom x, const vectorized_state &f_)
 		{
-			state_ikfom x_r;
-			x_r.pos = x.pos + f_.block<3, 1>(0, 0);
+			state_ikfom x_r = x; //不参与估计的分量保持不变
+			x_r.pos = x.pos + f_.template segment<3>(L::POS);
 
-			x_r.rot = x.rot * Sophus::SO3::exp(f_.block<3, 1>(3, 0));
-			x_r.offset_R_L_I = x.offset_R_L_I * Sophus::SO3::exp(f_.block<3, 1>(6, 0));
+			x_r.rot = x.rot * Sophus::SO3::exp(f_.template segment<3>(L::ROT));
+			if (L::EXTRINSIC)
+			{
+				x_r.offset_R_L_I = x.offset_R_L_I * Sophus::SO3::exp(f_.template segment<3>(L::OFF_R));
+				x_r.offset_T_L_I = x.offset_T_L_I + f_.template segment<3>(L::OFF_T);
+			}
 
-			x_r.offset_T_L_I = x.offset_T_L_I + f_.block<3, 1>(9, 0);
-			x_r.vel = x.vel + f_.block<3, 1>(12, 0);
-			x_r.bg = x.bg + f_.block<3, 1>(15, 0);
-			x_r.ba = x.ba + f_.block<3, 1>(18, 0);
-			x_r.grav = x.grav + f_.block<3, 1>(21, 0);
+			x_r.vel = x.vel + f_.template segment<3>(L::VEL);
+			x_r.bg = x.bg + f_.template segment<3>(L::BG);
+			x_r.ba = x.ba + f_.template segment<3>(L::BA);
+			if (L::GRAVITY)
+				x_r.grav = x.grav + f_.template segment<3>(L::GRAV);
 
 			return x_r;
 		}
 
 		//前向传播  公式(4-8)
+		//F = I + Fx*dt 只有POS/VEL/ROT三个块行不是单位阵，Fw只有4个非零块，因此按3X3块更新P_，不构造稠密的F和Fw
 		void predict(double &dt, Eigen::Matrix<double, 12, 12> &Q, const input_ikfom &i_in)
 		{
-			Eigen::Matrix<double, 24, 1> f_ = get_f(x_, i_in);	  //公式(3)的f
-			Eigen::Matrix<double, 24, 24> f_x_ = df_dx(x_, i_in); //公式(7)的df/dx
-			Eigen::Matrix<double, 24, 12> f_w_ = df_dw(x_, i_in); //公式(7)的df/dw
+			flush_predict(); //先合并未完成的批量传播
+
+			vectorized_state f_ = get_f<L>(x_, i_in); //公式(3)的f
+			M3D R = x_.rot.matrix();
+			M3D A = -R * Sophus::SO3::hat(i_in.acc - x_.ba); //公式(7)中Fx的(VEL,ROT)块
 
 			x_ = boxplus(x_, f_ * dt); //前向传播 公式(4)
 
-			f_x_ = Matrix<double, 24, 24>::Identity() + f_x_ * dt; //之前Fx矩阵里的项没加单位阵，没乘dt   这里补上
+			//传播协方差矩阵，即公式(8): F*P*F^T = F*(F*P)^T
+			F_mul_rows(P_, dt, A, R, L::POS, L::ROT, L::VEL, L::BG, L::BA, L::GRAV);
+			P_.transposeInPlace();
+			F_mul_rows(P_, dt, A, R, L::POS, L::ROT, L::VEL, L::BG, L::BA, L::GRAV);
+			add_process_noise(P_, dt, R, Q, L::ROT, L::VEL, L::BG, L::BA);
+		}
+
+		//批量前向传播：状态逐步传播，协方差只累乘状态转移Phi = F_k*...*F_1 和噪声Qd，调用flush_predict()时才作用到P_上
+		//Phi只有POS/VEL/ROT三个块行不是单位阵，只保存这9行；Qd只在{POS,ROT,VEL,BG,BA}子空间内非零，只保存15X15
+		void predict_batch(double &dt, Eigen::Matrix<double, 12, 12> &Q, const input_ikfom &i_in)
+		{
+			vectorized_state f_ = get_f<L>(x_, i_in);
+			M3D R = x_.rot.matrix();
+			M3D A = -R * Sophus::SO3::hat(i_in.acc - x_.ba);
+
+			x_ = boxplus(x_, f_ * dt);
 
-			P_ = (f_x_)*P_ * (f_x_).transpose() + (dt * f_w_) * Q * (dt * f_w_).transpose(); //传播协方差矩阵，即公式(8)
+			if (batch_steps_ == 0)
+			{
+				Phi_rows_.setZero();
+				Phi_rows_.template block<3, 3>(0, L::POS).setIdentity();
+				Phi_rows_.template block<3, 3>(3, L::VEL).setIdentity();
+				Phi_rows_.template block<3, 3>(6, L::ROT).setIdentity();
+				Qd_.setZero();
+			}
+
+			//Phi <- F*Phi  (Phi_rows_的0-2行对应POS，3-5行对应VEL，6-8行对应ROT，Phi的其余行为单位阵的行)
+			Phi_rows_.template middleRows<3>(0) += dt * Phi_rows_.template middleRows<3>(3);
+			Phi_rows_.template middleRows<3>(3) += dt * A * Phi_rows_.template middleRows<3>(6);
+			Phi_rows_.template block<3, 3>(3, L::BA) -= dt * R;
+			if (L::GRAVITY)
+				Phi_rows_.template block<3, 3>(3, L::GRAV) += dt * M3D::Identity();
+			Phi_rows_.template block<3, 3>(6, L::BG) -= dt * M3D::Identity();
+
+			//Qd <- F*Qd*F^T + Fw*Q*Fw^T*dt^2，子空间内的下标: POS 0, ROT 3, VEL 6, BG 9, BA 12
+			F_mul_rows(Qd_, dt, A, R, 0, 3, 6, 9, 12, -1);
+			Qd_.transposeInPlace();
+			F_mul_rows(Qd_, dt, A, R, 0, 3, 6, 9, 12, -1);
+			add_process_noise(Qd_, dt, R, Q, 3, 6, 9, 12);
+
+			batch_steps_++;
+		}
+
+		//把批量传播累积的Phi和Qd作用到P_上: P_ = Phi*P_*Phi^T + Qd
+		void flush_predict()
+		{
+			if (batch_steps_ == 0)
+				return;
+
+			Matrix<double, 9, DIM> PhiP = Phi_rows_ * P_;
+			P_.template middleRows<3>(L::POS) = PhiP.template middleRows<3>(0);
+			P_.template middleRows<3>(L::VEL) = PhiP.template middleRows<3>(3);
+			P_.template middleRows<3>(L::ROT) = PhiP.template middleRows<3>(6);
+			P_.transposeInPlace();
+			PhiP = Phi_rows_ * P_;
+			P_.template middleRows<3>(L::POS) = PhiP.template middleRows<3>(0);
+			P_.template middleRows<3>(L::VEL) = PhiP.template middleRows<3>(3);
+			P_.template middleRows<3>(L::ROT) = PhiP.template middleRows<3>(6);
+
+			const int sub[5] = {0, 3, 6, 9, 12};
+			const int full[5] = {L::POS, L::ROT, L::VEL, L::BG, L::BA};
+			for (int i = 0; i < 5; i++)
+				for (int j = 0; j < 5; j++)
+					P_.template block<3, 3>(full[i], full[j]) += Qd_.template block<3, 3>(sub[i], sub[j]);
+
+			batch_steps_ = 0;
+		}
+
+		//计算单个特征点对应的雅可比矩阵H的一行(1XH_DIM)  point_为lidar系下的点, norm_vec为对应平面的法向量
+		Matrix<double, 1, H_DIM> h_row(const V3D &point_, const V3D &norm_vec, const M3D &rot_T, const M3D &offset_R, bool extrinsic_est)
+		{
+			V3D point_I_ = offset_R * point_ + x_.offset_T_L_I;
+			M3D point_I_crossmat;
+			point_I_crossmat << SKEW_SYM_MATRX(point_I_);
+
+			V3D C(rot_T * norm_vec);
+			V3D A(point_I_crossmat * C);
+			Matrix<double, 1, H_DIM> row = Matrix<double, 1, H_DIM>::Zero();
+			row.template segment<3>(0) = norm_vec.transpose();
+			row.template segment<3>(3) = A.transpose();
+			if (L::EXTRINSIC && extrinsic_est) //外参不估计时 H 只有前6列
+			{
+				M3D point_crossmat;
+				point_crossmat << SKEW_SYM_MATRX(point_);
+				V3D B(point_crossmat * offset_R.transpose() * C);
+				row.template segment<3>(H_DIM - 6) = B.transpose();
+				row.template segment<3>(H_DIM - 3) = C.transpose();
+			}
+			return row;
 		}
 
 		//计算每个特征点的残差及H矩阵
-		void h_share_model(dyn_share_datastruct &ekfom_data, PointCloudXYZI::Ptr &feats_down_body,
-						   KD_TREE<PointType> &ikdtree, vector<PointVector> &Nearest_Points, bool extrinsic_est)
+		void h_share_model(dyn_share_t &ekfom_data, PointCloudXYZI::Ptr &feats_down_body,
+						   local_map &map, vector<MapPointVector> &Nearest_Points, bool extrinsic_est)
 		{
 			int feats_down_size = feats_down_body->points.size();
-			laserCloudOri->clear();
-			corr_normvect->clear();
+			residual_workspace &ws = ws_;
+
+			const M3D rot_T = x_.rot.matrix().transpose();
+			const M3D offset_R = x_.offset_R_L_I.matrix();
+			Matrix<double, H_DIM, H_DIM> HTH = Matrix<double, H_DIM, H_DIM>::Zero();
+			Matrix<double, H_DIM, 1> HTz = Matrix<double, H_DIM, 1>::Zero();
+			int effct_feat_num = 0; //有效特征点的数量
+			int searched = 0, skipped = 0, rejected = 0;
+			int plane_hits = 0, plane_misses = 0;
+			double plane_fit_time = 0;
+			vector<pair<int64_t, plane_cache::entry>> new_planes; //本次新拟合的平面，并行循环结束后再写入缓存
+			const float reuse_sq = reuse_dist_ > 0 ? reuse_dist_ * reuse_dist_ : -1.f;
+
+			//需要重新搜索近邻的点先集中起来，在地图中一次性批量搜索
+			if (ekfom_data.converge)
+			{
+				ws.queries.clear();
+				for (int i = 0; i < feats_down_size; i++)
+				{
+					const PointType &point_body = feats_down_body->points[i];
+					V3D p_global(x_.rot * (offset_R * V3D(point_body.x, point_body.y, point_body.z) + x_.offset_T_L_I) + x_.pos);
+					float dx = p_global(0) - ws.search_x[i], dy = p_global(1) - ws.search_y[i], dz = p_global(2) - ws.search_z[i];
+					if (!ws.searched[i] || dx * dx + dy * dy + dz * dz > reuse_sq)
+					{
+						MapPointType point_world;
+						point_world.x = p_global(0);
+						point_world.y = p_global(1);
+						point_world.z = p_global(2);
+						ws.batch_slot[i] = ws.queries.size();
+						ws.queries.push_back(point_world);
+					}
+					else
+					{
+						ws.batch_slot[i] = -1; //位移很小，沿用上次的近邻和平面
+					}
+				}
+				//把匹配的距离阈值传给搜索，超出阈值的子树不再搜索，近邻不足的点提前放弃
+				map.nearest_search_batch(ws.queries, NUM_MATCH_POINTS, ws.batch, sqrt(MATCH_MAX_SQ_DIST));
+				searched = ws.queries.size();
+				rejected = ws.batch.rejected;
+				skipped = feats_down_size - searched;
+			}
 
 #ifdef MP_EN
 			omp_set_num_threads(MP_PROC_NUM);
-#pragma omp parallel for
+#pragma omp parallel
 #endif
-
-			for (int i = 0; i < feats_down_size; i++) //遍历所有的特征点
 			{
-				PointType &point_body = feats_down_body->points[i];
-				PointType point_world;
-
-				V3D p_body(point_body.x, point_body.y, point_body.z);
-				//把Lidar坐标系的点先转到IMU坐标系，再根据前向传播估计的位姿x，转到世界坐标系
-				V3D p_global(x_.rot * (x_.offset_R_L_I * p_body + x_.offset_T_L_I) + x_.pos);
-				point_world.x = p_global(0);
-				point_world.y = p_global(1);
-				point_world.z = p_global(2);
-				point_world.intensity = point_body.intensity;
-
-				vector<float> pointSearchSqDis(NUM_MATCH_POINTS);
-				auto &points_near = Nearest_Points[i]; // Nearest_Points[i]打印出来发现是按照离point_world距离，从小到大的顺序的vector
-
-				double ta = omp_get_wtime();
-				if (ekfom_data.converge)
-				{
-					//寻找point_world的最近邻的平面点
-					ikdtree.Nearest_Search(point_world, NUM_MATCH_POINTS, points_near, pointSearchSqDis);
-					//判断是否是有效匹配点，与loam系列类似，要求特征点最近邻的地图点数量>阈值，距离<阈值  满足条件的才置为true
-					point_selected_surf[i] = points_near.size() < NUM_MATCH_POINTS ? false : pointSearchSqDis[NUM_MATCH_POINTS - 1] > 5 ? false
-																																		: true;
-				}
-				if (!point_selected_surf[i])
-					continue; //如果该点不满足条件  不进行下面步骤
+				//每个线程各自累加H^T*H和H^T*z，最后再合并(信息形式)
+				Matrix<double, H_DIM, H_DIM> HTH_local = Matrix<double, H_DIM, H_DIM>::Zero();
+				Matrix<double, H_DIM, 1> HTz_local = Matrix<double, H_DIM, 1>::Zero();
+				int effct_num_local = 0;
+				int plane_hits_local = 0, plane_misses_local = 0;
+				double plane_fit_time_local = 0;
+				vector<pair<int64_t, plane_cache::entry>> new_planes_local;
 
-				Matrix<float, 4, 1> pabcd;		//平面点信息
-				point_selected_surf[i] = false; //将该点设置为无效点，用来判断是否满足条件
-				//拟合平面方程ax+by+cz+d=0并求解点到平面距离
-				if (esti_plane(pabcd, points_near, 0.1f))
+#ifdef MP_EN
+#pragma omp for
+#endif
+				for (int i = 0; i < feats_down_size; i++) //遍历所有的特征点
 				{
-					float pd2 = pabcd(0) * point_world.x + pabcd(1) * point_world.y + pabcd(2) * point_world.z + pabcd(3); //当前点到平面的距离
-					float s = 1 - 0.9 * fabs(pd2) / sqrt(p_body.norm());												   //如果残差大于经验阈值，则认为该点是有效点  简言之，距离原点越近的lidar点  要求点到平面的距离越苛刻
+					PointType &point_body = feats_down_body->points[i];
+					PointType point_world;
+
+					V3D p_body(point_body.x, point_body.y, point_body.z);
+					//把Lidar坐标系的点先转到IMU坐标系，再根据前向传播估计的位姿x，转到世界坐标系
+					V3D p_global(x_.rot * (offset_R * p_body + x_.offset_T_L_I) + x_.pos);
+					point_world.x = p_global(0);
+					point_world.y = p_global(1);
+					point_world.z = p_global(2);
+					point_world.intensity = point_body.intensity;
 
-					if (s > 0.9) //如果残差大于阈值，则认为该点是有效点
+					auto &points_near = Nearest_Points[i]; // Nearest_Points[i]打印出来发现是按照离point_world距离，从小到大的顺序的vector
+
+					bool new_search = false;
+					if (ekfom_data.converge)
 					{
-						point_selected_surf[i] = true;
-						normvec->points[i].x = pabcd(0); //存储平面的单位法向量  以及当前点到平面距离
-						normvec->points[i].y = pabcd(1);
-						normvec->points[i].z = pabcd(2);
-						normvec->points[i].intensity = pd2;
+						int slot = ws.batch_slot[i];
+						if (slot >= 0)
+						{
+							//取出point_world的最近邻的平面点 (按距离从小到大排列)
+							int num = ws.batch.num[slot];
+							const MapPointType *nn = &ws.batch.points[slot * NUM_MATCH_POINTS];
+							points_near.assign(nn, nn + num);
+							//判断是否是有效匹配点，与loam系列类似，要求特征点最近邻的地图点数量>阈值，距离<阈值  满足条件的才置为true
+							ws.nn_valid[i] = num < NUM_MATCH_POINTS ? false : ws.batch.dists[slot * NUM_MATCH_POINTS + NUM_MATCH_POINTS - 1] > MATCH_MAX_SQ_DIST ? false
+																																									: true;
+							ws.searched[i] = 1;
+							ws.search_x[i] = point_world.x;
+							ws.search_y[i] = point_world.y;
+							ws.search_z[i] = point_world.z;
+							new_search = true;
+						}
+						ws.valid[i] = ws.nn_valid[i];
+					}
+					if (!ws.valid[i])
+						continue; //如果该点不满足条件  不进行下面步骤
+
+					ws.valid[i] = false; //将该点设置为无效点，用来判断是否满足条件
+					//拟合平面方程ax+by+cz+d=0 (近邻没有变化时平面也不变，直接用上次的结果)
+					if (new_search)
+					{
+						Matrix<float, 4, 1> pabcd; //平面点信息
+						if (plane_cache_ == nullptr)
+						{
+							ws.plane_valid[i] = esti_plane(pabcd, points_near, 0.1f);
+						}
+						else
+						{
+							int64_t key = plane_cache_->key(point_world);
+							if (plane_cache_->lookup(key, points_near, 0.1f, pabcd))
+							{
+								ws.plane_valid[i] = true;
+								plane_hits_local++;
+							}
+							else
+							{
+								double fit_start = omp_get_wtime();
+								ws.plane_valid[i] = esti_plane(pabcd, points_near, 0.1f);
+								plane_fit_time_local += omp_get_wtime() - fit_start;
+								plane_misses_local++;
+								if (ws.plane_valid[i])
+									new_planes_local.emplace_back(key, plane_cache::make_entry(pabcd, points_near));
+							}
+						}
+						ws.norm_x[i] = pabcd(0);
+						ws.norm_y[i] = pabcd(1);
+						ws.norm_z[i] = pabcd(2);
+						ws.plane_d[i] = pabcd(3);
+					}
+					//求解点到平面距离
+					if (ws.plane_valid[i])
+					{
+						float pd2 = ws.norm_x[i] * point_world.x + ws.norm_y[i] * point_world.y + ws.norm_z[i] * point_world.z + ws.plane_d[i]; //当前点到平面的距离
+						float s = 1 - 0.9 * fabs(pd2) / sqrt(p_body.norm());												   //如果残差大于经验阈值，则认为该点是有效点  简言之，距离原点越近的lidar点  要求点到平面的距离越苛刻
+
+						if (s > 0.9) //如果残差大于阈值，则认为该点是有效点
+						{
+							ws.valid[i] = true; //平面的单位法向量已存放在norm_x/y/z中，再存储当前点到平面距离
+							ws.pd2[i] = pd2;
+
+							if (info_form_update_)
+							{
+								//直接把该点的雅可比行累加进 H^T*H 和 H^T*z (残差z = -pd2)
+								Matrix<double, 1, H_DIM> row = h_row(p_body, V3D(ws.norm_x[i], ws.norm_y[i], ws.norm_z[i]), rot_T, offset_R, extrinsic_est);
+								HTH_local.noalias() += row.transpose() * row;
+								HTz_local.noalias() -= row.transpose() * double(pd2);
+								effct_num_local++;
+							}
+						}
 					}
 				}
+
+#ifdef MP_EN
+#pragma omp critical
+#endif
+				{
+					HTH += HTH_local;
+					HTz += HTz_local;
+					effct_feat_num += effct_num_local;
+					plane_hits += plane_hits_local;
+					plane_misses += plane_misses_local;
+					plane_fit_time += plane_fit_time_local;
+					new_planes.insert(new_planes.end(), new_planes_local.begin(), new_planes_local.end());
+				}
+			}
+			stats_.searched += searched;
+			stats_.skipped += skipped;
+			stats_.rejected += rejected;
+			stats_.plane_hits += plane_hits;
+			stats_.plane_misses += plane_misses;
+			stats_.plane_fit_time += plane_fit_time;
+			if (plane_cache_ != nullptr)
+			{
+				for (const auto &np : new_planes)
+					plane_cache_->insert(np.first, np.second);
 			}
 
-			int effct_feat_num = 0; //有效特征点的数量
-			for (int i = 0; i < feats_down_size; i++)
+			if (info_form_update_)
 			{
-				if (point_selected_surf[i]) //对于满足要求的点
+				ekfom_data.effct_feat_num = effct_feat_num;
+				if (effct_feat_num < 1)
 				{
-					laserCloudOri->points[effct_feat_num] = feats_down_body->points[i]; //把这些点重新存到laserCloudOri中
-					corr_normvect->points[effct_feat_num] = normvec->points[i];			//存储这些点对应的法向量和到平面的距离
-					effct_feat_num++;
+					ekfom_data.valid = false;
+					ROS_WARN("No Effective Points! \n");
+					return;
 				}
+				ekfom_data.HTH = HTH;
+				ekfom_data.HTz = HTz;
+				return;
+			}
+
+			for (int i = 0; i < feats_down_size; i++)
+			{
+				if (ws.valid[i]) //对于满足要求的点
+					effct_feat_num++;
 			}
+			ekfom_data.effct_feat_num = effct_feat_num;
 
 			if (effct_feat_num < 1)
 			{
@@ -170,38 +491,26 @@ namespace esekfom
 				return;
 			}
 
-			// 雅可比矩阵H和残差向量的计算
-			ekfom_data.h_x = MatrixXd::Zero(effct_feat_num, 12);
+			// 雅可比矩阵H和残差向量的计算  直接按有效掩码读取工作区，不再拷贝出压缩后的点云
+			ekfom_data.h_x = MatrixXd::Zero(effct_feat_num, H_DIM);
 			ekfom_data.h.resize(effct_feat_num);
 
-			for (int i = 0; i < effct_feat_num; i++)
+			for (int i = 0, k = 0; i < feats_down_size; i++)
 			{
-				V3D point_(laserCloudOri->points[i].x, laserCloudOri->points[i].y, laserCloudOri->points[i].z);
-				M3D point_crossmat;
-				point_crossmat << SKEW_SYM_MATRX(point_);
-				V3D point_I_ = x_.offset_R_L_I * point_ + x_.offset_T_L_I;
-				M3D point_I_crossmat;
-				point_I_crossmat << SKEW_SYM_MATRX(point_I_);
+				if (!ws.valid[i])
+					continue;
+				const PointType &point_body = feats_down_body->points[i];
+				V3D point_(point_body.x, point_body.y, point_body.z);
 
 				// 得到对应的平面的法向量
-				const PointType &norm_p = corr_normvect->points[i];
-				V3D norm_vec(norm_p.x, norm_p.y, norm_p.z);
+				V3D norm_vec(ws.norm_x[i], ws.norm_y[i], ws.norm_z[i]);
 
 				// 计算雅可比矩阵H
-				V3D C(x_.rot.matrix().transpose() * norm_vec);
-				V3D A(point_I_crossmat * C);
-				if (extrinsic_est)
-				{
-					V3D B(point_crossmat * x_.offset_R_L_I.matrix().transpose() * C);
-					ekfom_data.h_x.block<1, 12>(i, 0) << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), VEC_FROM_ARRAY(B), VEC_FROM_ARRAY(C);
-				}
-				else
-				{
-					ekfom_data.h_x.block<1, 12>(i, 0) << norm_p.x, norm_p.y, norm_p.z, VEC_FROM_ARRAY(A), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0;
-				}
+				ekfom_data.h_x.row(k) = h_row(point_, norm_vec, rot_T, offset_R, extrinsic_est);
 
 				//残差：点面距离
-				ekfom_data.h(i) = -norm_p.intensity;
+				ekfom_data.h(k) = -ws.pd2[i];
+				k++;
 			}
 		}
 
@@ -210,73 +519,96 @@ namespace esekfom
 		{
 			vectorized_state x_r = vectorized_state::Zero();
 
-			x_r.block<3, 1>(0, 0) = x1.pos - x2.pos;
+			x_r.template segment<3>(L::POS) = x1.pos - x2.pos;
 
-			x_r.block<3, 1>(3, 0) = Sophus::SO3(x2.rot.matrix().transpose() * x1.rot.matrix()).log();
-			x_r.block<3, 1>(6, 0) = Sophus::SO3(x2.offset_R_L_I.matrix().transpose() * x1.offset_R_L_I.matrix()).log();
+			x_r.template segment<3>(L::ROT) = Sophus::SO3(x2.rot.matrix().transpose() * x1.rot.matrix()).log();
+			if (L::EXTRINSIC)
+			{
+				x_r.template segment<3>(L::OFF_R) = Sophus::SO3(x2.offset_R_L_I.matrix().transpose() * x1.offset_R_L_I.matrix()).log();
+				x_r.template segment<3>(L::OFF_T) = x1.offset_T_L_I - x2.offset_T_L_I;
+			}
 
-			x_r.block<3, 1>(9, 0) = x1.offset_T_L_I - x2.offset_T_L_I;
-			x_r.block<3, 1>(12, 0) = x1.vel - x2.vel;
-			x_r.block<3, 1>(15, 0) = x1.bg - x2.bg;
-			x_r.block<3, 1>(18, 0) = x1.ba - x2.ba;
-			x_r.block<3, 1>(21, 0) = x1.grav - x2.grav;
+			x_r.template segment<3>(L::VEL) = x1.vel - x2.vel;
+			x_r.template segment<3>(L::BG) = x1.bg - x2.bg;
+			x_r.template segment<3>(L::BA) = x1.ba - x2.ba;
+			if (L::GRAVITY)
+				x_r.template segment<3>(L::GRAV) = x1.grav - x2.grav;
 
 			return x_r;
 		}
 
 		// ESKF
 		void update_iterated_dyn_share_modified(double R, PointCloudXYZI::Ptr &feats_down_body,
-												KD_TREE<PointType> &ikdtree, vector<PointVector> &Nearest_Points, int maximum_iter, bool extrinsic_est)
+												local_map &map, vector<MapPointVector> &Nearest_Points, int maximum_iter, bool extrinsic_est)
 		{
-			normvec->resize(int(feats_down_body->points.size()));
+			flush_predict();
+			ws_.resize(int(feats_down_body->points.size()));
+			ws_.reset_search(int(feats_down_body->points.size()));
+			stats_ = search_stats();
 
-			dyn_share_datastruct dyn_share;
+			dyn_share_t dyn_share;
 			dyn_share.valid = true;
 			dyn_share.converge = true;
 			int t = 0;
 			state_ikfom x_propagated = x_; //这里的x_和P_分别是经过正向传播后的状态量和协方差矩阵，因为会先调用predict函数再调用这个函数
 			cov P_propagated = P_;
 
-			vectorized_state dx_new = vectorized_state::Zero(); // 24X1的向量
+			vectorized_state dx_new = vectorized_state::Zero(); // DIMX1的向量
+
+			//迭代过程中P_不变，P_的前H_DIM列及其左上角块的Cholesky分解只需计算一次
+			Eigen::Matrix<double, DIM, H_DIM> P_h = P_.template leftCols<H_DIM>();
+			Eigen::LLT<Eigen::Matrix<double, H_DIM, H_DIM>> P_hh_llt(P_.template topLeftCorner<H_DIM, H_DIM>());
+			Eigen::Matrix<double, H_DIM, H_DIM> L_hh = P_hh_llt.matrixL();
+			Eigen::Matrix<double, H_DIM, H_DIM> G = Eigen::Matrix<double, H_DIM, H_DIM>::Zero();
 
 			for (int i = -1; i < maximum_iter; i++) // maximum_iter是卡尔曼滤波的最大迭代次数
 			{
 				dyn_share.valid = true;
 				// 计算雅克比，也就是点面残差的导数 H(代码里是h_x)
-				h_share_model(dyn_share, feats_down_body, ikdtree, Nearest_Points, extrinsic_est);
+				h_share_model(dyn_share, feats_down_body, map, Nearest_Points, extrinsic_est);
 
 				if (!dyn_share.valid)
 				{
 					continue;
 				}
 
-				vectorized_state dx;
 				dx_new = boxminus(x_, x_propagated); //公式(18)中的 x^k - x^
 
-				//由于H矩阵是稀疏的，只有前12列有非零元素，后12列是零 因此这里采用分块矩阵的形式计算 减少计算量
-				auto H = dyn_share.h_x;												// m X 12 的矩阵
-				Eigen::Matrix<double, 24, 24> HTH = Matrix<double, 24, 24>::Zero(); //矩阵 H^T * H
-				HTH.block<12, 12>(0, 0) = H.transpose() * H;
-
-				auto K_front = (HTH / R + P_.inverse()).inverse();
-				Eigen::Matrix<double, Eigen::Dynamic, Eigen::Dynamic> K;
-				K = K_front.block<24, 12>(0, 0) * H.transpose() / R; //卡尔曼增益  这里R视为常数
+				//由于H矩阵是稀疏的，只有前H_DIM列有非零元素，其余列是零 因此这里采用分块矩阵的形式计算 减少计算量
+				Eigen::Matrix<double, H_DIM, H_DIM> HTH; //矩阵 H^T * H 的非零块
+				Eigen::Matrix<double, H_DIM, 1> HTz;	 //向量 H^T * z
+				if (info_form_update_)
+				{
+					HTH = dyn_share.HTH;
+					HTz = dyn_share.HTz;
+				}
+				else
+				{
+					auto &H = dyn_share.h_x; // m X H_DIM 的矩阵
+					HTH = H.transpose() * H;
+					HTz = H.transpose() * dyn_share.h;
+				}
 
-				Eigen::Matrix<double, 24, 24> KH = Matrix<double, 24, 24>::Zero(); //矩阵 K * H
-				KH.block<24, 12>(0, 0) = K * H;
-				Matrix<double, 24, 1> dx_ = K * dyn_share.h + (KH - Matrix<double, 24, 24>::Identity()) * dx_new; //公式(18)
+				//K_front = (H^T*H/R + P^-1)^-1 = P - P_h*G*P_h^T  (Woodbury恒等式, S = H^T*H/R 只有H_DIM维)
+				//G = (I + S*P_hh)^-1 * S = L^-T * (I - (I + L^T*S*L)^-1) * L^-1，只需要分解H_DIM维的对称正定矩阵
+				Eigen::Matrix<double, H_DIM, H_DIM> S = HTH / R;
+				Eigen::Matrix<double, H_DIM, H_DIM> W = L_hh.transpose() * S * L_hh;
+				Eigen::Matrix<double, H_DIM, H_DIM> I_h = Eigen::Matrix<double, H_DIM, H_DIM>::Identity();
+				Eigen::Matrix<double, H_DIM, H_DIM> G_mid = I_h - (I_h + W).llt().solve(I_h);
+				G_mid = 0.5 * (G_mid + G_mid.transpose());
+				Eigen::Matrix<double, H_DIM, H_DIM> Y = P_hh_llt.matrixU().solve(G_mid); // L^-T * G_mid
+				G = P_hh_llt.matrixU().solve(Y.transpose()).transpose();					 // L^-T * G_mid * L^-1
+
+				//卡尔曼增益 K = K_front * H^T / R，只需要K_front的前H_DIM列
+				Eigen::Matrix<double, DIM, H_DIM> K_h = P_h - P_h * (G * P_h.template topRows<H_DIM>());
+				Eigen::Matrix<double, DIM, H_DIM> KH_h = K_h * S; //矩阵 K * H 的非零列
+				vectorized_state dx_ = K_h * HTz / R + KH_h * dx_new.template head<H_DIM>() - dx_new; //公式(18)
 				// std::cout << "dx_: " << dx_.transpose() << std::endl;
 				x_ = boxplus(x_, dx_); //公式(18)
+				stats_.iterations++;
 
-				dyn_share.converge = true;
-				for (int j = 0; j < 24; j++)
-				{
-					if (std::fabs(dx_[j]) > epsi) //如果dx>epsi 认为没有收敛
-					{
-						dyn_share.converge = false;
-						break;
-					}
-				}
+				double dx_max = dx_.cwiseAbs().maxCoeff();
+				dyn_share.converge = dx_max <= epsi; //如果dx>epsi 认为没有收敛
 
 				if (dyn_share.converge)
 					t++;
@@ -286,19 +618,57 @@ namespace esekfom
 					dyn_share.converge = true;
 				}
 
-				if (t > 1 || i == maximum_iter - 1)
+				if (t > 1 || i == maximum_iter - 1 || dx_max < stop_epsi_) //状态增量小于stop_epsi_时不必再迭代
 				{
-					P_ = (Matrix<double, 24, 24>::Identity() - KH) * P_; //公式(19)
+					//公式(19): (I - K*H)*P = K_front = P - P_h*G*P_h^T，写成对称形式并去除舍入误差，保持P_对称正定
+					P_ -= P_h * G * P_h.transpose();
+					P_ = 0.5 * (P_ + P_.transpose()).eval();
 					return;
 				}
 			}
 		}
 
 	private:
+		//M <- F*M, F = I + Fx*dt 只修改POS/VEL/ROT三个块行；按POS、VEL、ROT的顺序原地更新，每一步用到的都是未修改的行
+		template <typename Derived>
+		static void F_mul_rows(MatrixBase<Derived> &M, double dt, const M3D &A, const M3D &R,
+							   int pos, int rot, int vel, int bg, int ba, int grav)
+		{
+			M.template middleRows<3>(pos) += dt * M.template middleRows<3>(vel);
+			M.template middleRows<3>(vel) += dt * (A * M.template middleRows<3>(rot) - R * M.template middleRows<3>(ba));
+			if (grav >= 0)
+				M.template middleRows<3>(vel) += dt * M.template middleRows<3>(grav);
+			M.template middleRows<3>(rot) -= dt * M.template middleRows<3>(bg);
+		}
+
+		//M += (Fw*dt)*Q*(Fw*dt)^T，Fw只在ROT/VEL/BG/BA块行非零，分别为 -I, -R, I, I
+		template <typename Derived>
+		static void add_process_noise(MatrixBase<Derived> &M, double dt, const M3D &R, const Matrix<double, 12, 12> &Q,
+									  int rot, int vel, int bg, int ba)
+		{
+			const int row[4] = {rot, vel, bg, ba};
+			const M3D G[4] = {-M3D::Identity(), -R, M3D::Identity(), M3D::Identity()};
+			for (int i = 0; i < 4; i++)
+				for (int j = 0; j < 4; j++)
+					M.template block<3, 3>(row[i], row[j]) += (dt * dt) * G[i] * Q.template block<3, 3>(3 * i, 3 * j) * G[j].transpose();
+		}
+
 		state_ikfom x_;
 		cov P_ = cov::Identity();
+		bool info_form_update_ = true;
+		residual_workspace ws_; //残差工作区，每个滤波器实例各自持有，使滤波器可重入
+		float reuse_dist_ = -1.f;	//近邻复用的位移阈值，<0时每次都重新搜索
+		double stop_epsi_ = 0;		//状态增量小于该值时提前结束迭代
+		search_stats stats_;		//当前帧的近邻搜索统计
+		plane_cache *plane_cache_ = nullptr;
+
+		Matrix<double, 9, DIM> Phi_rows_; //批量传播累积的状态转移矩阵的POS/VEL/ROT块行
+		Matrix<double, 15, 15> Qd_;		  //批量传播累积的过程噪声
+		int batch_steps_ = 0;			  //尚未合并到P_的批量传播步数
 	};
 
+	typedef esekf_<state_layout_t> esekf; //按编译选项STATE_DIM选择的滤波器
+
 } // namespace esekfom
 
 #endif //  ESEKFOM_EKF_HPP1
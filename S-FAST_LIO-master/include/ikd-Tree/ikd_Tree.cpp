@@ -12,8 +12,14 @@ KD_TREE<PointType>::KD_TREE(float delete_param, float balance_param, float box_l
     delete_criterion_param = delete_param;
     balance_criterion_param = balance_param;
     downsample_size = box_length;
-    Rebuild_Logger.clear();
-    termination_flag = false;
+    for (int i = 0; i < Search_Reader_Slot_Num; i++)
+    {
+        Search_Readers[i].active[0] = 0;
+        Search_Readers[i].active[1] = 0;
+    }
+    search_epoch = 0;
+    pthread_mutex_init(&search_sync_mutex, NULL);
+    pthread_mutex_init(&tree_update_mutex_lock, NULL);
     start_thread();
 }
 
@@ -23,8 +29,13 @@ KD_TREE<PointType>::~KD_TREE()
     stop_thread();
     Delete_Storage_Disabled = true;
     delete_tree_nodes(&Root_Node);
+    for (KD_TREE_NODE *&root : Retired_Roots)
+        delete_tree_nodes(&root);
+    for (KD_TREE_NODE *&root : Retiring_Roots)
+        delete_tree_nodes(&root);
     PointVector().swap(PCL_Storage);
-    Rebuild_Logger.clear();
+    pthread_mutex_destroy(&search_sync_mutex);
+    pthread_mutex_destroy(&tree_update_mutex_lock);
 }
 
 
@@ -62,19 +73,246 @@ void KD_TREE<PointType>::InitTreeNode(KD_TREE_NODE *root)
     root->need_push_down_to_left = false;
     root->need_push_down_to_right = false;
     root->point_downsample_deleted = false;
+    root->tree_downsample_deleted = false;
     root->working_flag = false;
-    pthread_mutex_init(&(root->push_down_mutex_lock), NULL);
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::KD_TREE_NODE *KD_TREE<PointType>::New_Tree_Node()
+{
+    KD_TREE_NODE *node;
+    Node_Pool.alloc(1, &node);
+    InitTreeNode(node);
+    return node;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Set_Node_Point(KD_TREE_NODE *node, const PointType &point)
+{
+    node->point.x = point.x;
+    node->point.y = point.y;
+    node->point.z = point.z;
+    *node->payload = point;
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::Node_Pool_Stats KD_TREE<PointType>::node_pool_stats()
+{
+    return Node_Pool.stats();
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::Rebuild_Logger_Stats KD_TREE<PointType>::rebuild_logger_stats()
+{
+    Rebuild_Logger_Stats st;
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    st.peak = max_queue_size;
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    for (int i = 0; i < rebuild_thread_num; i++)
+    {
+        Rebuild_Task &task = Rebuild_Tasks[i];
+        pthread_mutex_lock(&task.rebuild_logger_mutex_lock);
+        st.size += task.Rebuild_Logger.size();
+        st.peak = max(st.peak, task.Rebuild_Logger.size());
+        st.memory += task.Rebuild_Logger.memory();
+        pthread_mutex_unlock(&task.rebuild_logger_mutex_lock);
+    }
+    st.soft_cap = rebuild_logger_soft_cap;
+    st.backpressure_waits = backpressure_waits;
+    st.backpressure_time = backpressure_time;
+    return st;
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::Tree_Stats KD_TREE<PointType>::tree_stats()
+{
+    Tree_Stats st;
+    st.searches = search_count.load(memory_order_relaxed);
+    st.nodes_visited = search_visited.load(memory_order_relaxed);
+    st.search_rejected = search_rejected.load(memory_order_relaxed);
+    st.reader_retries = reader_retries.load(memory_order_relaxed);
+    st.add_requests = add_requests;
+    st.points_inserted = points_inserted;
+    st.downsample_rejected = downsample_rejected;
+    st.delete_requests = delete_requests;
+    st.box_deleted = box_deleted;
+    st.sync_rebuilds = sync_rebuilds;
+    st.sync_rebuild_time = sync_rebuild_time;
+    st.lock_waits = lock_waits;
+    st.lock_wait_time = lock_wait_time;
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    st.background_rebuilds = background_rebuilds;
+    st.background_rebuild_time = background_rebuild_time;
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+    st.memory = Node_Pool.stats().memory + rebuild_logger_stats().memory;
+    st.memory += (PCL_Storage.capacity() + Downsample_Storage.capacity()) * sizeof(PointType);
+    pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
+    st.memory += (Points_deleted.capacity() + Multithread_Points_deleted.capacity()) * sizeof(PointType);
+    pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
+    return st;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::depth_histogram(vector<int> &histogram)
+{
+    histogram.clear();
+    int reader = Search_Enter();
+    Depth_Histogram(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), 0, histogram);
+    Search_Exit(reader);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Depth_Histogram(KD_TREE_NODE *root, int depth, vector<int> &histogram)
+{
+    if (root == nullptr)
+        return;
+    if (int(histogram.size()) <= depth)
+        histogram.resize(depth + 1, 0);
+    histogram[depth]++;
+    Depth_Histogram(__atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE), depth + 1, histogram);
+    Depth_Histogram(__atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE), depth + 1, histogram);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Lock_Working_Flag(Rebuild_Task *task)
+{
+    // Only the updating thread comes here; the wait is for a rebuild thread flattening or replaying this subtree
+    if (!pthread_mutex_trylock(&task->working_flag_mutex))
+        return;
+    auto t1 = chrono::high_resolution_clock::now();
+    pthread_mutex_lock(&task->working_flag_mutex);
+    lock_waits++;
+    lock_wait_time += chrono::duration<double>(chrono::high_resolution_clock::now() - t1).count();
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Rebuild_Logger_Backpressure()
+{
+    // Only called while holding no tree lock: the rebuild threads need working_flag_mutex to replay their logs.
+    if (rebuild_logger_soft_cap <= 0)
+        return;
+    for (int i = 0; i < rebuild_thread_num; i++)
+    {
+        Rebuild_Task &task = Rebuild_Tasks[i];
+        if (!task.rebuild_flag)
+            continue;
+        pthread_mutex_lock(&task.rebuild_logger_mutex_lock);
+        if (task.Rebuild_Logger.size() >= rebuild_logger_soft_cap)
+        {
+            auto t1 = chrono::high_resolution_clock::now();
+            backpressure_waits++;
+            while (task.rebuild_flag && task.Rebuild_Logger.size() >= rebuild_logger_soft_cap)
+            {
+                pthread_mutex_unlock(&task.rebuild_logger_mutex_lock);
+                usleep(100);
+                pthread_mutex_lock(&task.rebuild_logger_mutex_lock);
+            }
+            backpressure_time += chrono::duration<double>(chrono::high_resolution_clock::now() - t1).count();
+        }
+        pthread_mutex_unlock(&task.rebuild_logger_mutex_lock);
+    }
+}
+
+template <typename PointType>
+typename KD_TREE<PointType>::Rebuild_Task *KD_TREE<PointType>::Rebuild_Target(KD_TREE_NODE *node)
+{
+    if (node == nullptr)
+        return nullptr;
+    for (int i = 0; i < rebuild_thread_num; i++)
+    {
+        KD_TREE_NODE **rebuild_ptr = Rebuild_Tasks[i].Rebuild_Ptr;
+        if (rebuild_ptr != nullptr && *rebuild_ptr == node)
+            return &Rebuild_Tasks[i];
+    }
+    return nullptr;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Cancel_Rebuild(KD_TREE_NODE *node)
+{
+    // Drop a pending rebuild whose subtree became too small for the background threads
+    Rebuild_Task *task = Rebuild_Target(node);
+    if (task == nullptr)
+        return;
+    pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+    if (!task->rebuild_flag)
+        task->Rebuild_Ptr = nullptr;
+    pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+}
+
+template <typename PointType>
+int KD_TREE<PointType>::Search_Enter()
+{
+    static atomic<int> reader_counter(0);
+    static thread_local int slot = reader_counter.fetch_add(1) % Search_Reader_Slot_Num;
+    while (true)
+    {
+        int parity = search_epoch.load() & 1;
+        Search_Readers[slot].active[parity].fetch_add(1);
+        // A flip in between would let the writer miss this reader, so it must still be the current parity
+        if ((search_epoch.load() & 1) == parity)
+            return slot * 2 + parity;
+        Search_Readers[slot].active[parity].fetch_sub(1);
+        reader_retries.fetch_add(1, memory_order_relaxed);
+    }
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Search_Exit(int reader)
+{
+    Search_Readers[reader / 2].active[reader % 2].fetch_sub(1, memory_order_release);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Search_Synchronize()
+{
+    // New readers go to the other parity after the flip, so the old one drains even under constant searching.
+    // Readers that see the new parity started after the caller's publish and cannot reach the retired nodes.
+    pthread_mutex_lock(&search_sync_mutex);
+    int parity = search_epoch.fetch_add(1) & 1;
+    for (int i = 0; i < Search_Reader_Slot_Num; i++)
+    {
+        while (Search_Readers[i].active[parity].load(memory_order_acquire) != 0)
+            usleep(1);
+    }
+    pthread_mutex_unlock(&search_sync_mutex);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Reclaim_Retired()
+{
+    // Never waits: subtrees retired before the last flip are freed once its old parity has no readers,
+    // the ones retired since then start waiting with the next flip
+    if (!Retiring_Roots.empty())
+    {
+        for (int i = 0; i < Search_Reader_Slot_Num; i++)
+        {
+            if (Search_Readers[i].active[retiring_parity].load(memory_order_acquire) != 0)
+                return;
+        }
+        for (KD_TREE_NODE *&root : Retiring_Roots)
+            delete_tree_nodes(&root);
+        Retiring_Roots.clear();
+    }
+    if (!Retired_Roots.empty() && !pthread_mutex_trylock(&search_sync_mutex))
+    {
+        retiring_parity = search_epoch.fetch_add(1) & 1;
+        pthread_mutex_unlock(&search_sync_mutex);
+        Retiring_Roots.swap(Retired_Roots);
+    }
 }
 
 template <typename PointType>
 int KD_TREE<PointType>::size()
 {
+    KD_TREE_NODE *root = __atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE);
     int s = 0;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    Rebuild_Task *root_task = Rebuild_Target(root);
+    if (root_task == nullptr)
     {
-        if (Root_Node != nullptr)
+        if (root != nullptr)
         {
-            return Root_Node->TreeSize;
+            return root->TreeSize;
         }
         else
         {
@@ -83,10 +321,10 @@ int KD_TREE<PointType>::size()
     }
     else
     {
-        if (!pthread_mutex_trylock(&working_flag_mutex))
+        if (!pthread_mutex_trylock(&root_task->working_flag_mutex))
         {
-            s = Root_Node->TreeSize;
-            pthread_mutex_unlock(&working_flag_mutex);
+            s = root->TreeSize;
+            pthread_mutex_unlock(&root_task->working_flag_mutex);
             return s;
         }
         else
@@ -99,17 +337,19 @@ int KD_TREE<PointType>::size()
 template <typename PointType>
 BoxPointType KD_TREE<PointType>::tree_range()
 {
+    KD_TREE_NODE *root = __atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE);
     BoxPointType range;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    Rebuild_Task *root_task = Rebuild_Target(root);
+    if (root_task == nullptr)
     {
-        if (Root_Node != nullptr)
+        if (root != nullptr)
         {
-            range.vertex_min[0] = Root_Node->node_range_x[0];
-            range.vertex_min[1] = Root_Node->node_range_y[0];
-            range.vertex_min[2] = Root_Node->node_range_z[0];
-            range.vertex_max[0] = Root_Node->node_range_x[1];
-            range.vertex_max[1] = Root_Node->node_range_y[1];
-            range.vertex_max[2] = Root_Node->node_range_z[1];
+            range.vertex_min[0] = root->node_range_x[0];
+            range.vertex_min[1] = root->node_range_y[0];
+            range.vertex_min[2] = root->node_range_z[0];
+            range.vertex_max[0] = root->node_range_x[1];
+            range.vertex_max[1] = root->node_range_y[1];
+            range.vertex_max[2] = root->node_range_z[1];
         }
         else
         {
@@ -118,15 +358,15 @@ BoxPointType KD_TREE<PointType>::tree_range()
     }
     else
     {
-        if (!pthread_mutex_trylock(&working_flag_mutex))
+        if (!pthread_mutex_trylock(&root_task->working_flag_mutex))
         {
-            range.vertex_min[0] = Root_Node->node_range_x[0];
-            range.vertex_min[1] = Root_Node->node_range_y[0];
-            range.vertex_min[2] = Root_Node->node_range_z[0];
-            range.vertex_max[0] = Root_Node->node_range_x[1];
-            range.vertex_max[1] = Root_Node->node_range_y[1];
-            range.vertex_max[2] = Root_Node->node_range_z[1];
-            pthread_mutex_unlock(&working_flag_mutex);
+            range.vertex_min[0] = root->node_range_x[0];
+            range.vertex_min[1] = root->node_range_y[0];
+            range.vertex_min[2] = root->node_range_z[0];
+            range.vertex_max[0] = root->node_range_x[1];
+            range.vertex_max[1] = root->node_range_y[1];
+            range.vertex_max[2] = root->node_range_z[1];
+            pthread_mutex_unlock(&root_task->working_flag_mutex);
         }
         else
         {
@@ -139,20 +379,22 @@ BoxPointType KD_TREE<PointType>::tree_range()
 template <typename PointType>
 int KD_TREE<PointType>::validnum()
 {
+    KD_TREE_NODE *root = __atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE);
     int s = 0;
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    Rebuild_Task *root_task = Rebuild_Target(root);
+    if (root_task == nullptr)
     {
-        if (Root_Node != nullptr)
-            return (Root_Node->TreeSize - Root_Node->invalid_point_num);
+        if (root != nullptr)
+            return (root->TreeSize - root->invalid_point_num);
         else
             return 0;
     }
     else
     {
-        if (!pthread_mutex_trylock(&working_flag_mutex))
+        if (!pthread_mutex_trylock(&root_task->working_flag_mutex))
         {
-            s = Root_Node->TreeSize - Root_Node->invalid_point_num;
-            pthread_mutex_unlock(&working_flag_mutex);
+            s = root->TreeSize - root->invalid_point_num;
+            pthread_mutex_unlock(&root_task->working_flag_mutex);
             return s;
         }
         else
@@ -165,19 +407,21 @@ int KD_TREE<PointType>::validnum()
 template <typename PointType>
 void KD_TREE<PointType>::root_alpha(float &alpha_bal, float &alpha_del)
 {
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    KD_TREE_NODE *root = __atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE);
+    Rebuild_Task *root_task = Rebuild_Target(root);
+    if (root_task == nullptr)
     {
-        alpha_bal = Root_Node->alpha_bal;
-        alpha_del = Root_Node->alpha_del;
+        alpha_bal = root->alpha_bal;
+        alpha_del = root->alpha_del;
         return;
     }
     else
     {
-        if (!pthread_mutex_trylock(&working_flag_mutex))
+        if (!pthread_mutex_trylock(&root_task->working_flag_mutex))
         {
-            alpha_bal = Root_Node->alpha_bal;
-            alpha_del = Root_Node->alpha_del;
-            pthread_mutex_unlock(&working_flag_mutex);
+            alpha_bal = root->alpha_bal;
+            alpha_del = root->alpha_del;
+            pthread_mutex_unlock(&root_task->working_flag_mutex);
             return;
         }
         else
@@ -192,14 +436,20 @@ void KD_TREE<PointType>::root_alpha(float &alpha_bal, float &alpha_del)
 template <typename PointType>
 void KD_TREE<PointType>::start_thread()
 {
+    termination_flag = false;
     pthread_mutex_init(&termination_flag_mutex_lock, NULL);
     pthread_mutex_init(&rebuild_ptr_mutex_lock, NULL);
-    pthread_mutex_init(&rebuild_logger_mutex_lock, NULL);
     pthread_mutex_init(&points_deleted_rebuild_mutex_lock, NULL);
-    pthread_mutex_init(&working_flag_mutex, NULL);
-    pthread_mutex_init(&search_flag_mutex, NULL);
-    pthread_create(&rebuild_thread, NULL, multi_thread_ptr, (void *)this);
-    printf("Multi thread started \n");
+    for (int i = 0; i < rebuild_thread_num; i++)
+    {
+        Rebuild_Task &task = Rebuild_Tasks[i];
+        task.tree = this;
+        pthread_mutex_init(&task.working_flag_mutex, NULL);
+        pthread_mutex_init(&task.rebuild_logger_mutex_lock, NULL);
+    }
+    for (int i = 0; i < rebuild_thread_num; i++)
+        pthread_create(&Rebuild_Tasks[i].rebuild_thread, NULL, multi_thread_ptr, (void *)&Rebuild_Tasks[i]);
+    printf("Multi thread started (%d rebuild threads) \n", rebuild_thread_num);
 }
 
 template <typename PointType>
@@ -208,26 +458,44 @@ void KD_TREE<PointType>::stop_thread()
     pthread_mutex_lock(&termination_flag_mutex_lock);
     termination_flag = true;
     pthread_mutex_unlock(&termination_flag_mutex_lock);
-    if (rebuild_thread)
-        pthread_join(rebuild_thread, NULL);
+    for (int i = 0; i < rebuild_thread_num; i++)
+    {
+        Rebuild_Task &task = Rebuild_Tasks[i];
+        if (task.rebuild_thread)
+            pthread_join(task.rebuild_thread, NULL);
+        // Rebuilds still pending are simply dropped
+        task.Rebuild_Ptr = nullptr;
+        task.Rebuild_Root = nullptr;
+        task.Rebuild_Logger.clear();
+        pthread_mutex_destroy(&task.working_flag_mutex);
+        pthread_mutex_destroy(&task.rebuild_logger_mutex_lock);
+    }
     pthread_mutex_destroy(&termination_flag_mutex_lock);
-    pthread_mutex_destroy(&rebuild_logger_mutex_lock);
     pthread_mutex_destroy(&rebuild_ptr_mutex_lock);
     pthread_mutex_destroy(&points_deleted_rebuild_mutex_lock);
-    pthread_mutex_destroy(&working_flag_mutex);
-    pthread_mutex_destroy(&search_flag_mutex);
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::set_rebuild_thread_num(int thread_num)
+{
+    thread_num = max(1, min(thread_num, Max_Rebuild_Thread_Num));
+    if (thread_num == rebuild_thread_num)
+        return;
+    stop_thread();
+    rebuild_thread_num = thread_num;
+    start_thread();
 }
 
 template <typename PointType>
 void *KD_TREE<PointType>::multi_thread_ptr(void *arg)
 {
-    KD_TREE *handle = (KD_TREE *)arg;
-    handle->multi_thread_rebuild();
+    Rebuild_Task *task = (Rebuild_Task *)arg;
+    task->tree->multi_thread_rebuild(*task);
     return nullptr;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::multi_thread_rebuild()
+void KD_TREE<PointType>::multi_thread_rebuild(Rebuild_Task &task)
 {
     bool terminated = false;
     KD_TREE_NODE *father_ptr, **new_node_ptr;
@@ -237,102 +505,100 @@ void KD_TREE<PointType>::multi_thread_rebuild()
     while (!terminated)
     {
         pthread_mutex_lock(&rebuild_ptr_mutex_lock);
-        pthread_mutex_lock(&working_flag_mutex);
-        if (Rebuild_Ptr != nullptr)
+        // trylock: the mapping thread may hold working_flag_mutex while it waits for rebuild_ptr_mutex_lock
+        if (task.Rebuild_Ptr != nullptr && !pthread_mutex_trylock(&task.working_flag_mutex))
         {
+            task.rebuild_flag = true;
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
             /* Traverse and copy */
-            if (!Rebuild_Logger.empty())
+            if (!task.Rebuild_Logger.empty())
             {
                 printf("\n\n\n\n\n\n\n\n\n\n\n ERROR!!! \n\n\n\n\n\n\n\n\n");
             }
-            rebuild_flag = true;
-            if (*Rebuild_Ptr == Root_Node)
+            KD_TREE_NODE *root = __atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE);
+            if (*task.Rebuild_Ptr == root)
             {
-                Treesize_tmp = Root_Node->TreeSize;
-                Validnum_tmp = Root_Node->TreeSize - Root_Node->invalid_point_num;
-                alpha_bal_tmp = Root_Node->alpha_bal;
-                alpha_del_tmp = Root_Node->alpha_del;
+                Treesize_tmp = root->TreeSize;
+                Validnum_tmp = root->TreeSize - root->invalid_point_num;
+                alpha_bal_tmp = root->alpha_bal;
+                alpha_del_tmp = root->alpha_del;
             }
-            KD_TREE_NODE *old_root_node = (*Rebuild_Ptr);
-            father_ptr = (*Rebuild_Ptr)->father_ptr;
-            PointVector().swap(Rebuild_PCL_Storage);
-            // Lock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
-            {
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
-                pthread_mutex_lock(&search_flag_mutex);
-            }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
+            auto rebuild_start = chrono::high_resolution_clock::now();
+            KD_TREE_NODE *old_root_node = (*task.Rebuild_Ptr);
+            father_ptr = (*task.Rebuild_Ptr)->father_ptr;
+            PointVector().swap(task.Rebuild_PCL_Storage);
+            // Searches keep running inside the old subtree, so it is flattened without writing any node
             // Lock deleted points cache
             pthread_mutex_lock(&points_deleted_rebuild_mutex_lock);
-            flatten(*Rebuild_Ptr, Rebuild_PCL_Storage, MULTI_THREAD_REC);
+            Flatten_Rebuild(*task.Rebuild_Ptr, task.Rebuild_PCL_Storage, 0);
             // Unlock deleted points cache
             pthread_mutex_unlock(&points_deleted_rebuild_mutex_lock);
-            // Unlock Search
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&task.working_flag_mutex);
             /* Rebuild and update missed operations*/
             Operation_Logger_Type Operation;
             KD_TREE_NODE *new_root_node = nullptr;
-            if (int(Rebuild_PCL_Storage.size()) > 0)
+            int queue_peak = 0;
+            if (int(task.Rebuild_PCL_Storage.size()) > 0)
             {
-                BuildTree(&new_root_node, 0, Rebuild_PCL_Storage.size() - 1, Rebuild_PCL_Storage);
+                BuildTree(&new_root_node, 0, task.Rebuild_PCL_Storage.size() - 1, task.Rebuild_PCL_Storage);
                 // Rebuild has been done. Updates the blocked operations into the new tree
-                pthread_mutex_lock(&working_flag_mutex);
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&task.working_flag_mutex);
+                pthread_mutex_lock(&task.rebuild_logger_mutex_lock);
                 int tmp_counter = 0;
-                while (!Rebuild_Logger.empty())
+                while (!task.Rebuild_Logger.empty())
                 {
-                    Operation = Rebuild_Logger.front();
-                    max_queue_size = max(max_queue_size, Rebuild_Logger.size());
-                    Rebuild_Logger.pop();
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
-                    pthread_mutex_unlock(&working_flag_mutex);
+                    Operation = task.Rebuild_Logger.front();
+                    queue_peak = max(queue_peak, task.Rebuild_Logger.size());
+                    task.Rebuild_Logger.pop();
+                    pthread_mutex_unlock(&task.rebuild_logger_mutex_lock);
+                    pthread_mutex_unlock(&task.working_flag_mutex);
                     run_operation(&new_root_node, Operation);
                     tmp_counter++;
                     if (tmp_counter % 10 == 0)
                         usleep(1);
-                    pthread_mutex_lock(&working_flag_mutex);
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                    pthread_mutex_lock(&task.working_flag_mutex);
+                    pthread_mutex_lock(&task.rebuild_logger_mutex_lock);
                 }
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_unlock(&task.rebuild_logger_mutex_lock);
+                pthread_mutex_unlock(&task.working_flag_mutex);
             }
-            /* Replace to original tree*/
-            // pthread_mutex_lock(&working_flag_mutex);
-            pthread_mutex_lock(&search_flag_mutex);
-            while (search_mutex_counter != 0)
+            // Publishing and refreshing the ancestors must not interleave with the updating thread or another
+            // rebuild thread rewriting the same ancestors, so both run under tree_update_mutex_lock
+            pthread_mutex_lock(&tree_update_mutex_lock);
+            pthread_mutex_lock(&task.working_flag_mutex);
+            if (new_root_node != nullptr)
             {
-                pthread_mutex_unlock(&search_flag_mutex);
-                usleep(1);
-                pthread_mutex_lock(&search_flag_mutex);
+                // Operations logged while this thread waited for the lock
+                pthread_mutex_lock(&task.rebuild_logger_mutex_lock);
+                while (!task.Rebuild_Logger.empty())
+                {
+                    Operation = task.Rebuild_Logger.front();
+                    queue_peak = max(queue_peak, task.Rebuild_Logger.size());
+                    task.Rebuild_Logger.pop();
+                    run_operation(&new_root_node, Operation);
+                }
+                pthread_mutex_unlock(&task.rebuild_logger_mutex_lock);
             }
-            search_mutex_counter = -1;
-            pthread_mutex_unlock(&search_flag_mutex);
-            if (father_ptr->left_son_ptr == *Rebuild_Ptr)
+            /* Replace to original tree*/
+            // Publish the finished subtree; searches already inside the old one keep reading it until it is retired
+            if (new_root_node != nullptr)
+                new_root_node->father_ptr = father_ptr;
+            if (father_ptr->left_son_ptr == *task.Rebuild_Ptr)
             {
-                father_ptr->left_son_ptr = new_root_node;
+                __atomic_store_n(&father_ptr->left_son_ptr, new_root_node, __ATOMIC_RELEASE);
             }
-            else if (father_ptr->right_son_ptr == *Rebuild_Ptr)
+            else if (father_ptr->right_son_ptr == *task.Rebuild_Ptr)
             {
-                father_ptr->right_son_ptr = new_root_node;
+                __atomic_store_n(&father_ptr->right_son_ptr, new_root_node, __ATOMIC_RELEASE);
             }
             else
             {
                 throw "Error: Father ptr incompatible with current node\n";
             }
-            if (new_root_node != nullptr)
-                new_root_node->father_ptr = father_ptr;
-            (*Rebuild_Ptr) = new_root_node;
-            int valid_old = old_root_node->TreeSize - old_root_node->invalid_point_num;
-            int valid_new = new_root_node->TreeSize - new_root_node->invalid_point_num;
+            __atomic_store_n(task.Rebuild_Ptr, new_root_node, __ATOMIC_RELEASE);
             if (father_ptr == STATIC_ROOT_NODE)
-                Root_Node = STATIC_ROOT_NODE->left_son_ptr;
-            KD_TREE_NODE *update_root = *Rebuild_Ptr;
+                __atomic_store_n(&Root_Node, STATIC_ROOT_NODE->left_son_ptr, __ATOMIC_RELEASE);
+            KD_TREE_NODE *update_root = *task.Rebuild_Ptr;
             while (update_root != nullptr && update_root != Root_Node)
             {
                 update_root = update_root->father_ptr;
@@ -344,20 +610,24 @@ void KD_TREE<PointType>::multi_thread_rebuild()
                     break;
                 Update(update_root);
             }
-            pthread_mutex_lock(&search_flag_mutex);
-            search_mutex_counter = 0;
-            pthread_mutex_unlock(&search_flag_mutex);
-            Rebuild_Ptr = nullptr;
-            pthread_mutex_unlock(&working_flag_mutex);
-            rebuild_flag = false;
+            pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+            task.Rebuild_Ptr = nullptr;
+            task.Rebuild_Root = nullptr;
+            task.rebuild_flag = false;
+            max_queue_size = max(max_queue_size, queue_peak);
+            background_rebuilds++;
+            background_rebuild_time += chrono::duration<double>(chrono::high_resolution_clock::now() - rebuild_start).count();
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+            pthread_mutex_unlock(&task.working_flag_mutex);
+            pthread_mutex_unlock(&tree_update_mutex_lock);
             /* Delete discarded tree nodes */
+            Search_Synchronize();
             delete_tree_nodes(&old_root_node);
         }
         else
         {
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
         }
-        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
         pthread_mutex_lock(&termination_flag_mutex_lock);
         terminated = termination_flag;
         pthread_mutex_unlock(&termination_flag_mutex_lock);
@@ -408,47 +678,197 @@ void KD_TREE<PointType>::run_operation(KD_TREE_NODE **root, Operation_Logger_Typ
 template <typename PointType>
 void KD_TREE<PointType>::Build(PointVector point_cloud)
 {
+    auto t1 = chrono::high_resolution_clock::now();
     if (Root_Node != nullptr)
     {
         delete_tree_nodes(&Root_Node);
     }
     if (point_cloud.size() == 0)
         return;
-    STATIC_ROOT_NODE = new KD_TREE_NODE;
-    InitTreeNode(STATIC_ROOT_NODE);
-    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud);
+    if (STATIC_ROOT_NODE != nullptr)
+    {
+        STATIC_ROOT_NODE->left_son_ptr = nullptr;
+        delete_tree_nodes(&STATIC_ROOT_NODE);
+    }
+    STATIC_ROOT_NODE = New_Tree_Node();
+    BuildTree(&STATIC_ROOT_NODE->left_son_ptr, 0, point_cloud.size() - 1, point_cloud, build_parallel_depth);
     Update(STATIC_ROOT_NODE);
     STATIC_ROOT_NODE->TreeSize = 0;
     Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+    last_build.points = point_cloud.size();
+    last_build.time = chrono::duration<double>(chrono::high_resolution_clock::now() - t1).count();
+    last_build.throughput = last_build.points / max(last_build.time, 1e-9);
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+void KD_TREE<PointType>::Wait_For_Rebuilds()
 {
-    MANUAL_HEAP q(2 * k_nearest);
-    q.clear();
-    vector<float>().swap(Point_Distance);
-    if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+    // Returns once no slot holds a scheduled or running rebuild
+    while (true)
     {
-        Search(Root_Node, k_nearest, point, q, max_dist);
+        bool busy = false;
+        pthread_mutex_lock(&rebuild_ptr_mutex_lock);
+        for (int i = 0; i < rebuild_thread_num; i++)
+            busy |= Rebuild_Tasks[i].Rebuild_Ptr != nullptr;
+        pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
+        if (!busy)
+            break;
+        usleep(100);
     }
-    else
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::save_snapshot(const string &path)
+{
+    // The caller must not update the tree meanwhile; wait for the background rebuilds so the structure is stable
+    Wait_For_Rebuilds();
+    FILE *fp = fopen(path.c_str(), "wb");
+    if (fp == nullptr)
+    {
+        printf("ikd-Tree: cannot write snapshot %s\n", path.c_str());
+        return false;
+    }
+    Snapshot_Header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "IKDTREE", 8);
+    header.version = Snapshot_Version;
+    header.point_size = sizeof(PointType);
+    header.node_size = sizeof(Snapshot_Node);
+    header.point_offset = 64;
+    // Points are streamed while the node records are collected, the records follow the points
+    fseek(fp, header.point_offset, SEEK_SET);
+    vector<Snapshot_Node> records;
+    records.reserve(size());
+    Snapshot_Collect(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), records, fp);
+    header.node_num = records.size();
+    header.node_offset = header.point_offset + header.node_num * sizeof(PointType);
+    fwrite(records.data(), sizeof(Snapshot_Node), records.size(), fp);
+    fseek(fp, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, fp);
+    bool ok = !ferror(fp);
+    ok &= fclose(fp) == 0;
+    if (!ok)
+        printf("ikd-Tree: failed to write snapshot %s\n", path.c_str());
+    return ok;
+}
+
+template <typename PointType>
+bool KD_TREE<PointType>::load_snapshot(const string &path)
+{
+    auto t1 = chrono::high_resolution_clock::now();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(Snapshot_Header))
     {
-        pthread_mutex_lock(&search_flag_mutex);
-        while (search_mutex_counter == -1)
+        close(fd);
+        return false;
+    }
+    size_t file_size = st.st_size;
+    void *data = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return false;
+    const Snapshot_Header &header = *reinterpret_cast<const Snapshot_Header *>(data);
+    bool valid = memcmp(header.magic, "IKDTREE", 8) == 0 && header.version == Snapshot_Version &&
+                 header.point_size == sizeof(PointType) && header.node_size == sizeof(Snapshot_Node) &&
+                 header.node_num < uint64_t(INT32_MAX) && header.point_offset >= sizeof(Snapshot_Header) &&
+                 header.point_offset + header.node_num * sizeof(PointType) <= header.node_offset &&
+                 header.node_offset + header.node_num * sizeof(Snapshot_Node) <= file_size;
+    const PointType *points = reinterpret_cast<const PointType *>(static_cast<const char *>(data) + header.point_offset);
+    const Snapshot_Node *records = reinterpret_cast<const Snapshot_Node *>(static_cast<const char *>(data) + header.node_offset);
+    int n = valid ? header.node_num : 0;
+    if (valid)
+    {
+        madvise(data, file_size, MADV_SEQUENTIAL);
+        // Pre-order: children come after their parent and every node but the root is referenced exactly once,
+        // so the records form a single tree and no node is left unlinked
+        vector<bool> referenced(n, false);
+        for (int i = 0; i < n && valid; i++)
         {
-            pthread_mutex_unlock(&search_flag_mutex);
-            usleep(1);
-            pthread_mutex_lock(&search_flag_mutex);
+            valid = records[i].division_axis <= 2;
+            int32_t son[2] = {records[i].left, records[i].right};
+            for (int j = 0; j < 2 && valid; j++)
+            {
+                if (son[j] == -1)
+                    continue;
+                valid = son[j] > i && son[j] < n && !referenced[son[j]];
+                if (valid)
+                    referenced[son[j]] = true;
+            }
         }
-        search_mutex_counter += 1;
-        pthread_mutex_unlock(&search_flag_mutex);
-        Search(Root_Node, k_nearest, point, q, max_dist);
-        pthread_mutex_lock(&search_flag_mutex);
-        search_mutex_counter -= 1;
-        pthread_mutex_unlock(&search_flag_mutex);
-    }
-    int k_found = min(k_nearest, int(q.size()));
+        for (int i = 1; i < n && valid; i++)
+            valid = referenced[i];
+    }
+    if (!valid)
+    {
+        printf("ikd-Tree: %s is not a compatible snapshot\n", path.c_str());
+        munmap(data, file_size);
+        return false;
+    }
+    // The old tree is freed below, a background rebuild must not be flattening or publishing into it
+    Wait_For_Rebuilds();
+    if (Root_Node != nullptr)
+    {
+        delete_tree_nodes(&Root_Node);
+    }
+    if (STATIC_ROOT_NODE != nullptr)
+    {
+        STATIC_ROOT_NODE->left_son_ptr = nullptr;
+        delete_tree_nodes(&STATIC_ROOT_NODE);
+    }
+    if (n == 0)
+    {
+        munmap(data, file_size);
+        return true;
+    }
+    STATIC_ROOT_NODE = New_Tree_Node();
+    vector<KD_TREE_NODE *> nodes(n);
+    Node_Pool.alloc(n, nodes.data());
+#ifdef MP_EN
+#pragma omp parallel for num_threads(MP_PROC_NUM)
+#endif
+    for (int i = 0; i < n; i++)
+    {
+        KD_TREE_NODE *node = nodes[i];
+        InitTreeNode(node);
+        Set_Node_Point(node, points[i]);
+        node->division_axis = records[i].division_axis;
+        node->point_deleted = records[i].flags & 1;
+        node->point_downsample_deleted = records[i].flags & 2;
+        node->left_son_ptr = records[i].left >= 0 ? nodes[records[i].left] : nullptr;
+        node->right_son_ptr = records[i].right >= 0 ? nodes[records[i].right] : nullptr;
+    }
+    munmap(data, file_size);
+    // Reverse pre-order updates every subtree before its root, Update also links the father pointers
+    for (int i = n - 1; i >= 0; i--)
+        Update(nodes[i]);
+    STATIC_ROOT_NODE->left_son_ptr = nodes[0];
+    Update(STATIC_ROOT_NODE);
+    STATIC_ROOT_NODE->TreeSize = 0;
+    Root_Node = STATIC_ROOT_NODE->left_son_ptr;
+    last_build.points = n;
+    last_build.time = chrono::duration<double>(chrono::high_resolution_clock::now() - t1).count();
+    last_build.throughput = last_build.points / max(last_build.time, 1e-9);
+    return true;
+}
+
+template <typename PointType>
+void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist)
+{
+    MANUAL_HEAP q(2 * k_nearest);
+    q.clear();
+    vector<float>().swap(Point_Distance);
+    int reader = Search_Enter();
+    size_t visited = 0;
+    bool rejected = Search(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), k_nearest, point, q, max_dist, visited);
+    Search_Exit(reader);
+    search_count.fetch_add(1, memory_order_relaxed);
+    search_visited.fetch_add(visited, memory_order_relaxed);
+    if (rejected)
+        search_rejected.fetch_add(1, memory_order_relaxed);
+    int k_found = rejected ? 0 : min(k_nearest, int(q.size()));
     PointVector().swap(Nearest_Points);
     vector<float>().swap(Point_Distance);
     for (int i = 0; i < k_found; i++)
@@ -460,18 +880,111 @@ void KD_TREE<PointType>::Nearest_Search(PointType point, int k_nearest, PointVec
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Nearest_Search_Batch(const PointVector &points, int k_nearest, Batch_Search_Result &result, float max_dist)
+{
+    int n = points.size();
+    result.k = k_nearest;
+    if (result.points.size() < size_t(n) * k_nearest)
+    {
+        result.points.resize(size_t(n) * k_nearest);
+        result.dists.resize(size_t(n) * k_nearest);
+    }
+    if (result.num.size() < size_t(n))
+        result.num.resize(n);
+    result.order.resize(n);
+    result.rejected = 0;
+    if (n == 0)
+        return;
+
+    // Visit the queries along a Morton curve so that consecutive searches walk the same part of the tree
+    float min_xyz[3] = {INFINITY, INFINITY, INFINITY}, max_xyz[3] = {-INFINITY, -INFINITY, -INFINITY};
+    for (int i = 0; i < n; i++)
+    {
+        const float xyz[3] = {points[i].x, points[i].y, points[i].z};
+        for (int a = 0; a < 3; a++)
+        {
+            min_xyz[a] = min(min_xyz[a], xyz[a]);
+            max_xyz[a] = max(max_xyz[a], xyz[a]);
+        }
+    }
+    float scale[3];
+    for (int a = 0; a < 3; a++)
+        scale[a] = 2097151.0f / max(max_xyz[a] - min_xyz[a], 1e-6f);
+    for (int i = 0; i < n; i++)
+    {
+        const float xyz[3] = {points[i].x, points[i].y, points[i].z};
+        uint64_t code = 0;
+        for (int a = 0; a < 3; a++)
+        {
+            uint64_t v = uint64_t((xyz[a] - min_xyz[a]) * scale[a]) & 0x1fffff;
+            v = (v | v << 32) & 0x1f00000000ffffULL;
+            v = (v | v << 16) & 0x1f0000ff0000ffULL;
+            v = (v | v << 8) & 0x100f00f00f00f00fULL;
+            v = (v | v << 4) & 0x10c30c30c30c30c3ULL;
+            v = (v | v << 2) & 0x1249249249249249ULL;
+            code |= v << a;
+        }
+        result.order[i] = make_pair(code, i);
+    }
+    sort(result.order.begin(), result.order.end());
+
+    // Register as a reader once for the whole batch instead of once per query
+    int reader = Search_Enter();
+    KD_TREE_NODE *root = __atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE);
+    int rejected = 0;
+    size_t visited = 0;
+
+#ifdef MP_EN
+#pragma omp parallel num_threads(MP_PROC_NUM) reduction(+ : rejected, visited)
+#endif
+    {
+        MANUAL_HEAP q(2 * k_nearest);
+#ifdef MP_EN
+#pragma omp for schedule(static)
+#endif
+        for (int j = 0; j < n; j++)
+        {
+            int i = result.order[j].second;
+            q.clear();
+            int k_found = 0;
+            if (Search(root, k_nearest, points[i], q, max_dist, visited))
+                rejected++;
+            else
+                k_found = min(k_nearest, int(q.size()));
+            result.num[i] = k_found;
+            for (int m = k_found - 1; m >= 0; m--)
+            {
+                result.points[size_t(i) * k_nearest + m] = q.top().point;
+                result.dists[size_t(i) * k_nearest + m] = q.top().dist;
+                q.pop();
+            }
+        }
+    }
+
+    Search_Exit(reader);
+    result.rejected = rejected;
+    search_count.fetch_add(n, memory_order_relaxed);
+    search_visited.fetch_add(visited, memory_order_relaxed);
+    search_rejected.fetch_add(rejected, memory_order_relaxed);
+}
+
 template <typename PointType>
 void KD_TREE<PointType>::Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage)
 {
     Storage.clear();
-    Search_by_range(Root_Node, Box_of_Point, Storage);
+    int reader = Search_Enter();
+    Search_by_range(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), Box_of_Point, Storage);
+    Search_Exit(reader);
 }
 
 template <typename PointType>
 void KD_TREE<PointType>::Radius_Search(PointType point, const float radius, PointVector &Storage)
 {
     Storage.clear();
-    Search_by_radius(Root_Node, point, radius, Storage);
+    int reader = Search_Enter();
+    Search_by_radius(__atomic_load_n(&Root_Node, __ATOMIC_ACQUIRE), point, radius, Storage);
+    Search_Exit(reader);
 }
 
 template <typename PointType>
@@ -486,6 +999,8 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
     int tmp_counter = 0;
     for (int i = 0; i < PointToAdd.size(); i++)
     {
+        Rebuild_Logger_Backpressure();
+        pthread_mutex_lock(&tree_update_mutex_lock);
         if (downsample_switch)
         {
             Box_of_Point.vertex_min[0] = floor(PointToAdd[i].x / downsample_size) * downsample_size;
@@ -498,7 +1013,9 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
             mid_point.y = Box_of_Point.vertex_min[1] + (Box_of_Point.vertex_max[1] - Box_of_Point.vertex_min[1]) / 2.0;
             mid_point.z = Box_of_Point.vertex_min[2] + (Box_of_Point.vertex_max[2] - Box_of_Point.vertex_min[2]) / 2.0;
             PointVector().swap(Downsample_Storage);
+            int reader = Search_Enter();
             Search_by_range(Root_Node, Box_of_Point, Downsample_Storage);
+            Search_Exit(reader);
             min_dist = calc_dist(PointToAdd[i], mid_point);
             downsample_result = PointToAdd[i];
             for (int index = 0; index < Downsample_Storage.size(); index++)
@@ -510,7 +1027,8 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
                     downsample_result = Downsample_Storage[index];
                 }
             }
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+            Rebuild_Task *root_task = Rebuild_Target(Root_Node);
+            if (root_task == nullptr)
             {
                 if (Downsample_Storage.size() > 1 || same_point(PointToAdd[i], downsample_result))
                 {
@@ -529,26 +1047,27 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
                     operation_delete.op = DOWNSAMPLE_DELETE;
                     operation.point = downsample_result;
                     operation.op = ADD_POINT;
-                    pthread_mutex_lock(&working_flag_mutex);
+                    Lock_Working_Flag(root_task);
                     if (Downsample_Storage.size() > 0)
                         Delete_by_range(&Root_Node, Box_of_Point, false, true);
                     Add_by_point(&Root_Node, downsample_result, false, Root_Node->division_axis);
                     tmp_counter++;
-                    if (rebuild_flag)
+                    if (root_task->rebuild_flag)
                     {
-                        pthread_mutex_lock(&rebuild_logger_mutex_lock);
+                        pthread_mutex_lock(&root_task->rebuild_logger_mutex_lock);
                         if (Downsample_Storage.size() > 0)
-                            Rebuild_Logger.push(operation_delete);
-                        Rebuild_Logger.push(operation);
-                        pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                            root_task->Rebuild_Logger.push(operation_delete);
+                        root_task->Rebuild_Logger.push(operation);
+                        pthread_mutex_unlock(&root_task->rebuild_logger_mutex_lock);
                     }
-                    pthread_mutex_unlock(&working_flag_mutex);
+                    pthread_mutex_unlock(&root_task->working_flag_mutex);
                 };
             }
         }
         else
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+            Rebuild_Task *root_task = Rebuild_Target(Root_Node);
+            if (root_task == nullptr)
             {
                 Add_by_point(&Root_Node, PointToAdd[i], true, Root_Node->division_axis);
             }
@@ -557,18 +1076,24 @@ int KD_TREE<PointType>::Add_Points(PointVector &PointToAdd, bool downsample_on)
                 Operation_Logger_Type operation;
                 operation.point = PointToAdd[i];
                 operation.op = ADD_POINT;
-                pthread_mutex_lock(&working_flag_mutex);
+                Lock_Working_Flag(root_task);
                 Add_by_point(&Root_Node, PointToAdd[i], false, Root_Node->division_axis);
-                if (rebuild_flag)
+                if (root_task->rebuild_flag)
                 {
-                    pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                    Rebuild_Logger.push(operation);
-                    pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                    pthread_mutex_lock(&root_task->rebuild_logger_mutex_lock);
+                    root_task->Rebuild_Logger.push(operation);
+                    pthread_mutex_unlock(&root_task->rebuild_logger_mutex_lock);
                 }
-                pthread_mutex_unlock(&working_flag_mutex);
+                pthread_mutex_unlock(&root_task->working_flag_mutex);
             }
         }
+        pthread_mutex_unlock(&tree_update_mutex_lock);
     }
+    Reclaim_Retired();
+    add_requests += NewPointSize;
+    points_inserted += downsample_switch ? tmp_counter : NewPointSize;
+    if (downsample_switch)
+        downsample_rejected += NewPointSize - tmp_counter;
     return tmp_counter;
 }
 
@@ -577,7 +1102,10 @@ void KD_TREE<PointType>::Add_Point_Boxes(vector<BoxPointType> &BoxPoints)
 {
     for (int i = 0; i < BoxPoints.size(); i++)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        Rebuild_Logger_Backpressure();
+        pthread_mutex_lock(&tree_update_mutex_lock);
+        Rebuild_Task *root_task = Rebuild_Target(Root_Node);
+        if (root_task == nullptr)
         {
             Add_by_range(&Root_Node, BoxPoints[i], true);
         }
@@ -586,17 +1114,19 @@ void KD_TREE<PointType>::Add_Point_Boxes(vector<BoxPointType> &BoxPoints)
             Operation_Logger_Type operation;
             operation.boxpoint = BoxPoints[i];
             operation.op = ADD_BOX;
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(root_task);
             Add_by_range(&Root_Node, BoxPoints[i], false);
-            if (rebuild_flag)
+            if (root_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&root_task->rebuild_logger_mutex_lock);
+                root_task->Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&root_task->rebuild_logger_mutex_lock);
             }
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&root_task->working_flag_mutex);
         }
+        pthread_mutex_unlock(&tree_update_mutex_lock);
     }
+    Reclaim_Retired();
     return;
 }
 
@@ -605,7 +1135,10 @@ void KD_TREE<PointType>::Delete_Points(PointVector &PointToDel)
 {
     for (int i = 0; i < PointToDel.size(); i++)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        Rebuild_Logger_Backpressure();
+        pthread_mutex_lock(&tree_update_mutex_lock);
+        Rebuild_Task *root_task = Rebuild_Target(Root_Node);
+        if (root_task == nullptr)
         {
             Delete_by_point(&Root_Node, PointToDel[i], true);
         }
@@ -614,17 +1147,20 @@ void KD_TREE<PointType>::Delete_Points(PointVector &PointToDel)
             Operation_Logger_Type operation;
             operation.point = PointToDel[i];
             operation.op = DELETE_POINT;
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(root_task);
             Delete_by_point(&Root_Node, PointToDel[i], false);
-            if (rebuild_flag)
+            if (root_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&root_task->rebuild_logger_mutex_lock);
+                root_task->Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&root_task->rebuild_logger_mutex_lock);
             }
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&root_task->working_flag_mutex);
         }
+        pthread_mutex_unlock(&tree_update_mutex_lock);
     }
+    Reclaim_Retired();
+    delete_requests += PointToDel.size();
     return;
 }
 
@@ -634,7 +1170,10 @@ int KD_TREE<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints)
     int tmp_counter = 0;
     for (int i = 0; i < BoxPoints.size(); i++)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != Root_Node)
+        Rebuild_Logger_Backpressure();
+        pthread_mutex_lock(&tree_update_mutex_lock);
+        Rebuild_Task *root_task = Rebuild_Target(Root_Node);
+        if (root_task == nullptr)
         {
             tmp_counter += Delete_by_range(&Root_Node, BoxPoints[i], true, false);
         }
@@ -643,17 +1182,21 @@ int KD_TREE<PointType>::Delete_Point_Boxes(vector<BoxPointType> &BoxPoints)
             Operation_Logger_Type operation;
             operation.boxpoint = BoxPoints[i];
             operation.op = DELETE_BOX;
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(root_task);
             tmp_counter += Delete_by_range(&Root_Node, BoxPoints[i], false, false);
-            if (rebuild_flag)
+            if (root_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&root_task->rebuild_logger_mutex_lock);
+                root_task->Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&root_task->rebuild_logger_mutex_lock);
             }
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&root_task->working_flag_mutex);
         }
+        pthread_mutex_unlock(&tree_update_mutex_lock);
     }
+    Reclaim_Retired();
+    delete_requests += BoxPoints.size();
+    box_deleted += tmp_counter;
     return tmp_counter;
 }
 
@@ -676,13 +1219,36 @@ void KD_TREE<PointType>::acquire_removed_points(PointVector &removed_points)
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage)
+void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, int parallel_depth)
+{
+    if (l > r)
+        return;
+    vector<KD_TREE_NODE *> nodes(r - l + 1);
+    Node_Pool.alloc(r - l + 1, nodes.data());
+#ifdef MP_EN
+    if (parallel_depth > 0 && r - l + 1 >= Parallel_Build_Min_Size)
+    {
+#pragma omp parallel num_threads(MP_PROC_NUM)
+#pragma omp single
+        BuildTree(root, l, r, Storage, nodes.data(), parallel_depth);
+        return;
+    }
+#else
+    (void)parallel_depth;
+#endif
+    BuildTree(root, l, r, Storage, nodes.data());
+}
+
+// nodes[0 .. r-l] are preallocated nodes for Storage[l .. r]; each point takes the node at its own index,
+// so subtrees never share data and the first parallel_depth levels can hand them to OpenMP tasks
+template <typename PointType>
+void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, KD_TREE_NODE **nodes, int parallel_depth)
 {
     if (l > r)
         return;
-    *root = new KD_TREE_NODE;
-    InitTreeNode(*root);
     int mid = (l + r) >> 1;
+    *root = nodes[mid - l];
+    InitTreeNode(*root);
     int div_axis = 0;
     int i;
     // Find the best division Axis
@@ -722,10 +1288,24 @@ void KD_TREE<PointType>::BuildTree(KD_TREE_NODE **root, int l, int r, PointVecto
         nth_element(begin(Storage) + l, begin(Storage) + mid, begin(Storage) + r + 1, point_cmp_x);
         break;
     }
-    (*root)->point = Storage[mid];
+    Set_Node_Point(*root, Storage[mid]);
     KD_TREE_NODE *left_son = nullptr, *right_son = nullptr;
-    BuildTree(&left_son, l, mid - 1, Storage);
-    BuildTree(&right_son, mid + 1, r, Storage);
+#ifdef MP_EN
+    if (parallel_depth > 0 && r - l + 1 >= Parallel_Build_Min_Size)
+    {
+#pragma omp task shared(left_son, Storage)
+        BuildTree(&left_son, l, mid - 1, Storage, nodes, parallel_depth - 1);
+        BuildTree(&right_son, mid + 1, r, Storage, nodes + (mid + 1 - l), parallel_depth - 1);
+#pragma omp taskwait
+    }
+    else
+#else
+    (void)parallel_depth;
+#endif
+    {
+        BuildTree(&left_son, l, mid - 1, Storage, nodes);
+        BuildTree(&right_son, mid + 1, r, Storage, nodes + (mid + 1 - l));
+    }
     (*root)->left_son_ptr = left_son;
     (*root)->right_son_ptr = right_son;
     Update((*root));
@@ -736,29 +1316,68 @@ template <typename PointType>
 void KD_TREE<PointType>::Rebuild(KD_TREE_NODE **root)
 {
     KD_TREE_NODE *father_ptr;
-    if ((*root)->TreeSize >= Multi_Thread_Rebuild_Point_Num)
+    if ((*root)->TreeSize >= multi_thread_rebuild_point_num)
     {
         if (!pthread_mutex_trylock(&rebuild_ptr_mutex_lock))
         {
-            if (Rebuild_Ptr == nullptr || ((*root)->TreeSize > (*Rebuild_Ptr)->TreeSize))
+            // Scheduled subtrees must stay disjoint: a running rebuild below this subtree blocks it,
+            // pending ones below it are absorbed by it.
+            bool below[Max_Rebuild_Thread_Num] = {false};
+            bool blocked = false;
+            for (int i = 0; i < rebuild_thread_num; i++)
+            {
+                KD_TREE_NODE *node = Rebuild_Tasks[i].Rebuild_Ptr == nullptr ? nullptr : Rebuild_Tasks[i].Rebuild_Root;
+                while (node != nullptr && node != *root)
+                    node = node->father_ptr;
+                below[i] = node != nullptr;
+                blocked |= below[i] && Rebuild_Tasks[i].rebuild_flag;
+            }
+            if (!blocked)
             {
-                Rebuild_Ptr = root;
+                Rebuild_Task *free_task = nullptr, *smallest_task = nullptr;
+                for (int i = 0; i < rebuild_thread_num; i++)
+                {
+                    Rebuild_Task &task = Rebuild_Tasks[i];
+                    if (below[i])
+                        task.Rebuild_Ptr = nullptr;
+                    if (task.Rebuild_Ptr == nullptr)
+                    {
+                        if (free_task == nullptr)
+                            free_task = &task;
+                    }
+                    else if (!task.rebuild_flag && (smallest_task == nullptr || task.Rebuild_Root->TreeSize < smallest_task->Rebuild_Root->TreeSize))
+                    {
+                        smallest_task = &task;
+                    }
+                }
+                if (free_task == nullptr && smallest_task != nullptr && (*root)->TreeSize > smallest_task->Rebuild_Root->TreeSize)
+                    free_task = smallest_task;
+                if (free_task != nullptr)
+                {
+                    free_task->Rebuild_Ptr = root;
+                    free_task->Rebuild_Root = *root;
+                }
             }
             pthread_mutex_unlock(&rebuild_ptr_mutex_lock);
         }
     }
     else
     {
+        auto t1 = chrono::high_resolution_clock::now();
         father_ptr = (*root)->father_ptr;
-        int size_rec = (*root)->TreeSize;
+        KD_TREE_NODE *old_root_node = *root, *new_root_node = nullptr;
         PCL_Storage.clear();
-        flatten(*root, PCL_Storage, DELETE_POINTS_REC);
-        delete_tree_nodes(root);
-        BuildTree(root, 0, PCL_Storage.size() - 1, PCL_Storage);
-        if (*root != nullptr)
-            (*root)->father_ptr = father_ptr;
-        if (*root == Root_Node)
-            STATIC_ROOT_NODE->left_son_ptr = *root;
+        flatten(old_root_node, PCL_Storage, DELETE_POINTS_REC);
+        BuildTree(&new_root_node, 0, PCL_Storage.size() - 1, PCL_Storage);
+        // Publish the new subtree, the old one is freed by Reclaim_Retired once no search can be inside it
+        if (new_root_node != nullptr)
+            new_root_node->father_ptr = father_ptr;
+        __atomic_store_n(root, new_root_node, __ATOMIC_RELEASE);
+        if (root == &Root_Node)
+            __atomic_store_n(&STATIC_ROOT_NODE->left_son_ptr, new_root_node, __ATOMIC_RELEASE);
+        Retired_Roots.push_back(old_root_node);
+        sync_rebuilds++;
+        sync_rebuild_time += chrono::duration<double>(chrono::high_resolution_clock::now() - t1).count();
     }
     return;
 }
@@ -807,41 +1426,43 @@ int KD_TREE<PointType>::Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoi
     else
         delete_box_log.op = DELETE_BOX;
     delete_box_log.boxpoint = boxpoint;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+    Rebuild_Task *left_task = Rebuild_Target((*root)->left_son_ptr);
+    if (left_task == nullptr)
     {
         tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild, is_downsample);
     }
     else
     {
-        pthread_mutex_lock(&working_flag_mutex);
+        Lock_Working_Flag(left_task);
         tmp_counter += Delete_by_range(&((*root)->left_son_ptr), boxpoint, false, is_downsample);
-        if (rebuild_flag)
+        if (left_task->rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            pthread_mutex_lock(&left_task->rebuild_logger_mutex_lock);
+            left_task->Rebuild_Logger.push(delete_box_log);
+            pthread_mutex_unlock(&left_task->rebuild_logger_mutex_lock);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
+        pthread_mutex_unlock(&left_task->working_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    Rebuild_Task *right_task = Rebuild_Target((*root)->right_son_ptr);
+    if (right_task == nullptr)
     {
         tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild, is_downsample);
     }
     else
     {
-        pthread_mutex_lock(&working_flag_mutex);
+        Lock_Working_Flag(right_task);
         tmp_counter += Delete_by_range(&((*root)->right_son_ptr), boxpoint, false, is_downsample);
-        if (rebuild_flag)
+        if (right_task->rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(delete_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            pthread_mutex_lock(&right_task->rebuild_logger_mutex_lock);
+            right_task->Rebuild_Logger.push(delete_box_log);
+            pthread_mutex_unlock(&right_task->rebuild_logger_mutex_lock);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
+        pthread_mutex_unlock(&right_task->working_flag_mutex);
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < multi_thread_rebuild_point_num)
+        Cancel_Rebuild(*root);
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -857,7 +1478,7 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, PointType point, b
         return;
     (*root)->working_flag = true;
     Push_Down(*root);
-    if (same_point((*root)->point, point) && !(*root)->point_deleted)
+    if (same_point(*(*root)->payload, point) && !(*root)->point_deleted)
     {
         (*root)->point_deleted = true;
         (*root)->invalid_point_num += 1;
@@ -871,45 +1492,47 @@ void KD_TREE<PointType>::Delete_by_point(KD_TREE_NODE **root, PointType point, b
     delete_log.point = point;
     if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z))
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+        Rebuild_Task *left_task = Rebuild_Target((*root)->left_son_ptr);
+        if (left_task == nullptr)
         {
             Delete_by_point(&(*root)->left_son_ptr, point, allow_rebuild);
         }
         else
         {
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(left_task);
             Delete_by_point(&(*root)->left_son_ptr, point, false);
-            if (rebuild_flag)
+            if (left_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(delete_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&left_task->rebuild_logger_mutex_lock);
+                left_task->Rebuild_Logger.push(delete_log);
+                pthread_mutex_unlock(&left_task->rebuild_logger_mutex_lock);
             }
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&left_task->working_flag_mutex);
         }
     }
     else
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+        Rebuild_Task *right_task = Rebuild_Target((*root)->right_son_ptr);
+        if (right_task == nullptr)
         {
             Delete_by_point(&(*root)->right_son_ptr, point, allow_rebuild);
         }
         else
         {
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(right_task);
             Delete_by_point(&(*root)->right_son_ptr, point, false);
-            if (rebuild_flag)
+            if (right_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(delete_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&right_task->rebuild_logger_mutex_lock);
+                right_task->Rebuild_Logger.push(delete_log);
+                pthread_mutex_unlock(&right_task->rebuild_logger_mutex_lock);
             }
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&right_task->working_flag_mutex);
         }
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < multi_thread_rebuild_point_num)
+        Cancel_Rebuild(*root);
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -948,41 +1571,43 @@ void KD_TREE<PointType>::Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint
     struct timespec Timeout;
     add_box_log.op = ADD_BOX;
     add_box_log.boxpoint = boxpoint;
-    if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+    Rebuild_Task *left_task = Rebuild_Target((*root)->left_son_ptr);
+    if (left_task == nullptr)
     {
         Add_by_range(&((*root)->left_son_ptr), boxpoint, allow_rebuild);
     }
     else
     {
-        pthread_mutex_lock(&working_flag_mutex);
+        Lock_Working_Flag(left_task);
         Add_by_range(&((*root)->left_son_ptr), boxpoint, false);
-        if (rebuild_flag)
+        if (left_task->rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            pthread_mutex_lock(&left_task->rebuild_logger_mutex_lock);
+            left_task->Rebuild_Logger.push(add_box_log);
+            pthread_mutex_unlock(&left_task->rebuild_logger_mutex_lock);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
+        pthread_mutex_unlock(&left_task->working_flag_mutex);
     }
-    if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+    Rebuild_Task *right_task = Rebuild_Target((*root)->right_son_ptr);
+    if (right_task == nullptr)
     {
         Add_by_range(&((*root)->right_son_ptr), boxpoint, allow_rebuild);
     }
     else
     {
-        pthread_mutex_lock(&working_flag_mutex);
+        Lock_Working_Flag(right_task);
         Add_by_range(&((*root)->right_son_ptr), boxpoint, false);
-        if (rebuild_flag)
+        if (right_task->rebuild_flag)
         {
-            pthread_mutex_lock(&rebuild_logger_mutex_lock);
-            Rebuild_Logger.push(add_box_log);
-            pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+            pthread_mutex_lock(&right_task->rebuild_logger_mutex_lock);
+            right_task->Rebuild_Logger.push(add_box_log);
+            pthread_mutex_unlock(&right_task->rebuild_logger_mutex_lock);
         }
-        pthread_mutex_unlock(&working_flag_mutex);
+        pthread_mutex_unlock(&right_task->working_flag_mutex);
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < multi_thread_rebuild_point_num)
+        Cancel_Rebuild(*root);
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -996,11 +1621,12 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
 {
     if (*root == nullptr)
     {
-        *root = new KD_TREE_NODE;
-        InitTreeNode(*root);
-        (*root)->point = point;
-        (*root)->division_axis = (father_axis + 1) % 3;
-        Update(*root);
+        // Link the node only once it is complete, searches may be walking the tree
+        KD_TREE_NODE *new_node = New_Tree_Node();
+        Set_Node_Point(new_node, point);
+        new_node->division_axis = (father_axis + 1) % 3;
+        Update(new_node);
+        __atomic_store_n(root, new_node, __ATOMIC_RELEASE);
         return;
     }
     (*root)->working_flag = true;
@@ -1011,45 +1637,47 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
     Push_Down(*root);
     if (((*root)->division_axis == 0 && point.x < (*root)->point.x) || ((*root)->division_axis == 1 && point.y < (*root)->point.y) || ((*root)->division_axis == 2 && point.z < (*root)->point.z))
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->left_son_ptr != *Rebuild_Ptr)
+        Rebuild_Task *left_task = Rebuild_Target((*root)->left_son_ptr);
+        if (left_task == nullptr)
         {
             Add_by_point(&(*root)->left_son_ptr, point, allow_rebuild, (*root)->division_axis);
         }
         else
         {
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(left_task);
             Add_by_point(&(*root)->left_son_ptr, point, false, (*root)->division_axis);
-            if (rebuild_flag)
+            if (left_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(add_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&left_task->rebuild_logger_mutex_lock);
+                left_task->Rebuild_Logger.push(add_log);
+                pthread_mutex_unlock(&left_task->rebuild_logger_mutex_lock);
             }
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&left_task->working_flag_mutex);
         }
     }
     else
     {
-        if ((Rebuild_Ptr == nullptr) || (*root)->right_son_ptr != *Rebuild_Ptr)
+        Rebuild_Task *right_task = Rebuild_Target((*root)->right_son_ptr);
+        if (right_task == nullptr)
         {
             Add_by_point(&(*root)->right_son_ptr, point, allow_rebuild, (*root)->division_axis);
         }
         else
         {
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(right_task);
             Add_by_point(&(*root)->right_son_ptr, point, false, (*root)->division_axis);
-            if (rebuild_flag)
+            if (right_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(add_log);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&right_task->rebuild_logger_mutex_lock);
+                right_task->Rebuild_Logger.push(add_log);
+                pthread_mutex_unlock(&right_task->rebuild_logger_mutex_lock);
             }
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&right_task->working_flag_mutex);
         }
     }
     Update(*root);
-    if (Rebuild_Ptr != nullptr && *Rebuild_Ptr == *root && (*root)->TreeSize < Multi_Thread_Rebuild_Point_Num)
-        Rebuild_Ptr = nullptr;
+    if ((*root)->TreeSize < multi_thread_rebuild_point_num)
+        Cancel_Rebuild(*root);
     bool need_rebuild = allow_rebuild & Criterion_Check((*root));
     if (need_rebuild)
         Rebuild(root);
@@ -1058,197 +1686,112 @@ void KD_TREE<PointType>::Add_by_point(KD_TREE_NODE **root, PointType point, bool
     return;
 }
 
+// Searches never write to the tree. A pending Push_Down is applied on the fly instead: lazy_tag is 0 if no ancestor
+// has deletion tags waiting for this node, 1 if it has, and 2 if those tags also mark the node downsample-deleted.
+// With a finite max_dist, pending is an upper bound on the valid points in the sibling subtrees still to be visited.
+// The search gives up and returns true as soon as fewer than k_nearest points can lie within max_dist.
 template <typename PointType>
-void KD_TREE<PointType>::Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist)
+bool KD_TREE<PointType>::Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist, size_t &visited, int lazy_tag, int pending)
 {
-    if (root == nullptr || root->tree_deleted)
-        return;
+    if (root == nullptr)
+        return false;
+    visited++;
+    bool tree_downsample_deleted, tree_deleted, point_deleted;
+    Lazy_Flags(root, lazy_tag, tree_downsample_deleted, tree_deleted, point_deleted);
+    if (tree_deleted)
+        return false;
     float cur_dist = calc_box_dist(root, point);
     float max_dist_sqr = max_dist * max_dist;
     if (cur_dist > max_dist_sqr)
-        return;
-    int retval;
-    if (root->need_push_down_to_left || root->need_push_down_to_right)
-    {
-        retval = pthread_mutex_trylock(&(root->push_down_mutex_lock));
-        if (retval == 0)
-        {
-            Push_Down(root);
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-        else
-        {
-            pthread_mutex_lock(&(root->push_down_mutex_lock));
-            pthread_mutex_unlock(&(root->push_down_mutex_lock));
-        }
-    }
-    if (!root->point_deleted)
+        return false;
+    if (!point_deleted)
     {
         float dist = calc_dist(point, root->point);
         if (dist <= max_dist_sqr && (q.size() < k_nearest || dist < q.top().dist))
         {
             if (q.size() >= k_nearest)
                 q.pop();
-            PointType_CMP current_point{root->point, dist};
+            PointType_CMP current_point{*root->payload, dist};
             q.push(current_point);
         }
     }
-    int cur_search_counter;
-    float dist_left_node = calc_box_dist(root->left_son_ptr, point);
-    float dist_right_node = calc_box_dist(root->right_son_ptr, point);
+    KD_TREE_NODE *left_son_ptr = __atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE);
+    KD_TREE_NODE *right_son_ptr = __atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE);
+    int son_tag = tree_downsample_deleted ? 2 : 1;
+    int left_tag = (lazy_tag != 0 || root->need_push_down_to_left) ? son_tag : 0;
+    int right_tag = (lazy_tag != 0 || root->need_push_down_to_right) ? son_tag : 0;
+    float dist_left_node = calc_box_dist(left_son_ptr, point);
+    float dist_right_node = calc_box_dist(right_son_ptr, point);
+    int left_bound = 0, right_bound = 0;
+    if (max_dist < INFINITY && q.size() < k_nearest)
+    {
+        left_bound = dist_left_node <= max_dist_sqr ? valid_upper_bound(left_son_ptr, left_tag) : 0;
+        right_bound = dist_right_node <= max_dist_sqr ? valid_upper_bound(right_son_ptr, right_tag) : 0;
+        if (q.size() + left_bound + right_bound + pending < k_nearest)
+            return true;
+    }
     if (q.size() < k_nearest || dist_left_node < q.top().dist && dist_right_node < q.top().dist)
     {
         if (dist_left_node <= dist_right_node)
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-            {
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            if (Search(left_son_ptr, k_nearest, point, q, max_dist, visited, left_tag, pending + right_bound))
+                return true;
             if (q.size() < k_nearest || dist_right_node < q.top().dist)
-            {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-                {
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                }
-                else
-                {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
-            }
+                return Search(right_son_ptr, k_nearest, point, q, max_dist, visited, right_tag, pending);
         }
         else
         {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-            {
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
+            if (Search(right_son_ptr, k_nearest, point, q, max_dist, visited, right_tag, pending + left_bound))
+                return true;
             if (q.size() < k_nearest || dist_left_node < q.top().dist)
-            {
-                if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-                {
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                }
-                else
-                {
-                    pthread_mutex_lock(&search_flag_mutex);
-                    while (search_mutex_counter == -1)
-                    {
-                        pthread_mutex_unlock(&search_flag_mutex);
-                        usleep(1);
-                        pthread_mutex_lock(&search_flag_mutex);
-                    }
-                    search_mutex_counter += 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                    pthread_mutex_lock(&search_flag_mutex);
-                    search_mutex_counter -= 1;
-                    pthread_mutex_unlock(&search_flag_mutex);
-                }
-            }
+                return Search(left_son_ptr, k_nearest, point, q, max_dist, visited, left_tag, pending);
         }
     }
     else
     {
         if (dist_left_node < q.top().dist)
-        {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
-            {
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->left_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
-        }
+            Search(left_son_ptr, k_nearest, point, q, max_dist, visited, left_tag);
         if (dist_right_node < q.top().dist)
-        {
-            if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
-            {
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-            }
-            else
-            {
-                pthread_mutex_lock(&search_flag_mutex);
-                while (search_mutex_counter == -1)
-                {
-                    pthread_mutex_unlock(&search_flag_mutex);
-                    usleep(1);
-                    pthread_mutex_lock(&search_flag_mutex);
-                }
-                search_mutex_counter += 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-                Search(root->right_son_ptr, k_nearest, point, q, max_dist);
-                pthread_mutex_lock(&search_flag_mutex);
-                search_mutex_counter -= 1;
-                pthread_mutex_unlock(&search_flag_mutex);
-            }
-        }
+            Search(right_son_ptr, k_nearest, point, q, max_dist, visited, right_tag);
     }
-    return;
+    return false;
+}
+
+// Valid points below node, with a pending Push_Down applied the same way Search applies it
+template <typename PointType>
+int KD_TREE<PointType>::valid_upper_bound(KD_TREE_NODE *node, int lazy_tag)
+{
+    if (node == nullptr || lazy_tag == 2)
+        return 0;
+    return node->TreeSize - (lazy_tag == 1 ? node->down_del_num : node->invalid_point_num);
 }
 
+// Deletion flags of root with a pending Push_Down from its ancestors applied (lazy_tag as in Search)
 template <typename PointType>
-void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage)
+void KD_TREE<PointType>::Lazy_Flags(KD_TREE_NODE *root, int lazy_tag, bool &tree_downsample_deleted, bool &tree_deleted, bool &point_deleted)
+{
+    tree_downsample_deleted = root->tree_downsample_deleted;
+    tree_deleted = root->tree_deleted;
+    point_deleted = root->point_deleted;
+    if (lazy_tag != 0)
+    {
+        // Same result as Push_Down from an ancestor that is live (1), downsample deleted (2) or tree_deleted (3)
+        tree_downsample_deleted |= lazy_tag == 2;
+        tree_deleted = lazy_tag != 1 || tree_downsample_deleted;
+        point_deleted = tree_deleted || root->point_downsample_deleted;
+    }
+}
+
+// Box and radius searches are readers as well: they never push down and skip tree_deleted subtrees
+template <typename PointType>
+void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage, int lazy_tag)
 {
     if (root == nullptr)
         return;
-    Push_Down(root);
+    bool tree_downsample_deleted, tree_deleted, point_deleted;
+    Lazy_Flags(root, lazy_tag, tree_downsample_deleted, tree_deleted, point_deleted);
+    if (tree_deleted)
+        return;
     if (boxpoint.vertex_max[0] <= root->node_range_x[0] || boxpoint.vertex_min[0] > root->node_range_x[1])
         return;
     if (boxpoint.vertex_max[1] <= root->node_range_y[0] || boxpoint.vertex_min[1] > root->node_range_y[1])
@@ -1257,43 +1800,29 @@ void KD_TREE<PointType>::Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoi
         return;
     if (boxpoint.vertex_min[0] <= root->node_range_x[0] && boxpoint.vertex_max[0] > root->node_range_x[1] && boxpoint.vertex_min[1] <= root->node_range_y[0] && boxpoint.vertex_max[1] > root->node_range_y[1] && boxpoint.vertex_min[2] <= root->node_range_z[0] && boxpoint.vertex_max[2] > root->node_range_z[1])
     {
-        flatten(root, Storage, NOT_RECORD);
+        Collect_Valid(root, Storage, lazy_tag);
         return;
     }
     if (boxpoint.vertex_min[0] <= root->point.x && boxpoint.vertex_max[0] > root->point.x && boxpoint.vertex_min[1] <= root->point.y && boxpoint.vertex_max[1] > root->point.y && boxpoint.vertex_min[2] <= root->point.z && boxpoint.vertex_max[2] > root->point.z)
     {
-        if (!root->point_deleted)
-            Storage.push_back(root->point);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
-    {
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
-    }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->left_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
-    {
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
-    }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_range(root->right_son_ptr, boxpoint, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
+        if (!point_deleted)
+            Storage.push_back(*root->payload);
     }
+    int son_tag = tree_downsample_deleted ? 2 : 1;
+    Search_by_range(__atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE), boxpoint, Storage, (lazy_tag != 0 || root->need_push_down_to_left) ? son_tag : 0);
+    Search_by_range(__atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE), boxpoint, Storage, (lazy_tag != 0 || root->need_push_down_to_right) ? son_tag : 0);
     return;
 }
 
 template <typename PointType>
-void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage)
+void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage, int lazy_tag)
 {
     if (root == nullptr)
         return;
-    Push_Down(root);
+    bool tree_downsample_deleted, tree_deleted, point_deleted;
+    Lazy_Flags(root, lazy_tag, tree_downsample_deleted, tree_deleted, point_deleted);
+    if (tree_deleted)
+        return;
     PointType range_center;
     range_center.x = (root->node_range_x[0] + root->node_range_x[1]) * 0.5;
     range_center.y = (root->node_range_y[0] + root->node_range_y[1]) * 0.5;
@@ -1302,35 +1831,54 @@ void KD_TREE<PointType>::Search_by_radius(KD_TREE_NODE *root, PointType point, f
     if (dist > radius + sqrt(root->radius_sq)) return;
     if (dist <= radius - sqrt(root->radius_sq)) 
     {
-        flatten(root, Storage, NOT_RECORD);
+        Collect_Valid(root, Storage, lazy_tag);
         return;
     }
-    if (!root->point_deleted && calc_dist(root->point, point) <= radius * radius){
-        Storage.push_back(root->point);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->left_son_ptr != *Rebuild_Ptr)
-    {
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
+    if (!point_deleted && calc_dist(point, root->point) <= radius * radius){
+        Storage.push_back(*root->payload);
     }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->left_son_ptr, point, radius, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
-    }
-    if ((Rebuild_Ptr == nullptr) || root->right_son_ptr != *Rebuild_Ptr)
-    {
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
-    }
-    else
-    {
-        pthread_mutex_lock(&search_flag_mutex);
-        Search_by_radius(root->right_son_ptr, point, radius, Storage);
-        pthread_mutex_unlock(&search_flag_mutex);
-    }    
+    int son_tag = tree_downsample_deleted ? 2 : 1;
+    Search_by_radius(__atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE), point, radius, Storage, (lazy_tag != 0 || root->need_push_down_to_left) ? son_tag : 0);
+    Search_by_radius(__atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE), point, radius, Storage, (lazy_tag != 0 || root->need_push_down_to_right) ? son_tag : 0);
     return;
 }
 
+// Read-only counterpart of flatten(root, Storage, NOT_RECORD) for readers
+template <typename PointType>
+void KD_TREE<PointType>::Collect_Valid(KD_TREE_NODE *root, PointVector &Storage, int lazy_tag)
+{
+    if (root == nullptr)
+        return;
+    bool tree_downsample_deleted, tree_deleted, point_deleted;
+    Lazy_Flags(root, lazy_tag, tree_downsample_deleted, tree_deleted, point_deleted);
+    if (tree_deleted)
+        return;
+    if (!point_deleted)
+        Storage.push_back(*root->payload);
+    int son_tag = tree_downsample_deleted ? 2 : 1;
+    Collect_Valid(__atomic_load_n(&root->left_son_ptr, __ATOMIC_ACQUIRE), Storage, (lazy_tag != 0 || root->need_push_down_to_left) ? son_tag : 0);
+    Collect_Valid(__atomic_load_n(&root->right_son_ptr, __ATOMIC_ACQUIRE), Storage, (lazy_tag != 0 || root->need_push_down_to_right) ? son_tag : 0);
+}
+
+// Read-only counterpart of flatten(root, Storage, MULTI_THREAD_REC) for the rebuild threads: searches may be
+// inside the subtree, so the pending tags are applied on the fly instead of pushed down
+template <typename PointType>
+void KD_TREE<PointType>::Flatten_Rebuild(KD_TREE_NODE *root, PointVector &Storage, int lazy_tag)
+{
+    if (root == nullptr)
+        return;
+    bool tree_downsample_deleted, tree_deleted, point_deleted;
+    Lazy_Flags(root, lazy_tag, tree_downsample_deleted, tree_deleted, point_deleted);
+    bool point_downsample_deleted = root->point_downsample_deleted || lazy_tag == 2;
+    if (!point_deleted)
+        Storage.push_back(*root->payload);
+    int son_tag = tree_downsample_deleted ? 2 : (tree_deleted ? 3 : 1);
+    Flatten_Rebuild(root->left_son_ptr, Storage, (lazy_tag != 0 || root->need_push_down_to_left) ? son_tag : 0);
+    Flatten_Rebuild(root->right_son_ptr, Storage, (lazy_tag != 0 || root->need_push_down_to_right) ? son_tag : 0);
+    if (point_deleted && !point_downsample_deleted)
+        Multithread_Points_deleted.push_back(*root->payload);
+}
+
 template <typename PointType>
 bool KD_TREE<PointType>::Criterion_Check(KD_TREE_NODE *root)
 {
@@ -1367,7 +1915,8 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
     operation.tree_downsample_deleted = root->tree_downsample_deleted;
     if (root->need_push_down_to_left && root->left_son_ptr != nullptr)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->left_son_ptr)
+        Rebuild_Task *left_task = Rebuild_Target(root->left_son_ptr);
+        if (left_task == nullptr)
         {
             root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
@@ -1385,7 +1934,7 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
         }
         else
         {
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(left_task);
             root->left_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->left_son_ptr->tree_deleted = root->tree_deleted || root->left_son_ptr->tree_downsample_deleted;
@@ -1398,19 +1947,20 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
                 root->left_son_ptr->invalid_point_num = root->left_son_ptr->down_del_num;
             root->left_son_ptr->need_push_down_to_left = true;
             root->left_son_ptr->need_push_down_to_right = true;
-            if (rebuild_flag)
+            if (left_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&left_task->rebuild_logger_mutex_lock);
+                left_task->Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&left_task->rebuild_logger_mutex_lock);
             }
             root->need_push_down_to_left = false;
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&left_task->working_flag_mutex);
         }
     }
     if (root->need_push_down_to_right && root->right_son_ptr != nullptr)
     {
-        if (Rebuild_Ptr == nullptr || *Rebuild_Ptr != root->right_son_ptr)
+        Rebuild_Task *right_task = Rebuild_Target(root->right_son_ptr);
+        if (right_task == nullptr)
         {
             root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
@@ -1428,7 +1978,7 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
         }
         else
         {
-            pthread_mutex_lock(&working_flag_mutex);
+            Lock_Working_Flag(right_task);
             root->right_son_ptr->tree_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->point_downsample_deleted |= root->tree_downsample_deleted;
             root->right_son_ptr->tree_deleted = root->tree_deleted || root->right_son_ptr->tree_downsample_deleted;
@@ -1441,14 +1991,14 @@ void KD_TREE<PointType>::Push_Down(KD_TREE_NODE *root)
                 root->right_son_ptr->invalid_point_num = root->right_son_ptr->down_del_num;
             root->right_son_ptr->need_push_down_to_left = true;
             root->right_son_ptr->need_push_down_to_right = true;
-            if (rebuild_flag)
+            if (right_task->rebuild_flag)
             {
-                pthread_mutex_lock(&rebuild_logger_mutex_lock);
-                Rebuild_Logger.push(operation);
-                pthread_mutex_unlock(&rebuild_logger_mutex_lock);
+                pthread_mutex_lock(&right_task->rebuild_logger_mutex_lock);
+                right_task->Rebuild_Logger.push(operation);
+                pthread_mutex_unlock(&right_task->rebuild_logger_mutex_lock);
             }
             root->need_push_down_to_right = false;
-            pthread_mutex_unlock(&working_flag_mutex);
+            pthread_mutex_unlock(&right_task->working_flag_mutex);
         }
     }
     return;
@@ -1631,7 +2181,7 @@ void KD_TREE<PointType>::flatten(KD_TREE_NODE *root, PointVector &Storage, delet
     Push_Down(root);
     if (!root->point_deleted)
     {
-        Storage.push_back(root->point);
+        Storage.push_back(*root->payload);
     }
     flatten(root->left_son_ptr, Storage, storage_type);
     flatten(root->right_son_ptr, Storage, storage_type);
@@ -1642,13 +2192,13 @@ void KD_TREE<PointType>::flatten(KD_TREE_NODE *root, PointVector &Storage, delet
     case DELETE_POINTS_REC:
         if (root->point_deleted && !root->point_downsample_deleted)
         {
-            Points_deleted.push_back(root->point);
+            Points_deleted.push_back(*root->payload);
         }
         break;
     case MULTI_THREAD_REC:
         if (root->point_deleted && !root->point_downsample_deleted)
         {
-            Multithread_Points_deleted.push_back(root->point);
+            Multithread_Points_deleted.push_back(*root->payload);
         }
         break;
     default:
@@ -1662,17 +2212,44 @@ void KD_TREE<PointType>::delete_tree_nodes(KD_TREE_NODE **root)
 {
     if (*root == nullptr)
         return;
-    Push_Down(*root);
-    delete_tree_nodes(&(*root)->left_son_ptr);
-    delete_tree_nodes(&(*root)->right_son_ptr);
-
-    pthread_mutex_destroy(&(*root)->push_down_mutex_lock);
-    delete *root;
+    vector<KD_TREE_NODE *> nodes;
+    Collect_Tree_Nodes(*root, nodes);
+    Node_Pool.release(nodes.data(), nodes.size());
     *root = nullptr;
 
     return;
 }
 
+template <typename PointType>
+void KD_TREE<PointType>::Collect_Tree_Nodes(KD_TREE_NODE *root, vector<KD_TREE_NODE *> &nodes)
+{
+    if (root == nullptr)
+        return;
+    Push_Down(root);
+    nodes.push_back(root);
+    Collect_Tree_Nodes(root->left_son_ptr, nodes);
+    Collect_Tree_Nodes(root->right_son_ptr, nodes);
+}
+
+template <typename PointType>
+int32_t KD_TREE<PointType>::Snapshot_Collect(KD_TREE_NODE *root, vector<Snapshot_Node> &records, FILE *fp)
+{
+    if (root == nullptr)
+        return -1;
+    Push_Down(root);
+    int32_t index = records.size();
+    records.emplace_back();
+    records[index].division_axis = root->division_axis;
+    records[index].flags = (root->point_deleted ? 1 : 0) | (root->point_downsample_deleted ? 2 : 0);
+    records[index].reserved[0] = records[index].reserved[1] = 0;
+    fwrite(root->payload, sizeof(PointType), 1, fp);
+    int32_t left = Snapshot_Collect(root->left_son_ptr, records, fp);
+    int32_t right = Snapshot_Collect(root->right_son_ptr, records, fp);
+    records[index].left = left;
+    records[index].right = right;
+    return index;
+}
+
 template <typename PointType>
 bool KD_TREE<PointType>::same_point(PointType a, PointType b)
 {
@@ -1680,7 +2257,7 @@ bool KD_TREE<PointType>::same_point(PointType a, PointType b)
 }
 
 template <typename PointType>
-float KD_TREE<PointType>::calc_dist(PointType a, PointType b)
+float KD_TREE<PointType>::calc_dist(const PointType &a, const PointType &b)
 {
     float dist = 0.0f;
     dist = (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
@@ -1688,7 +2265,13 @@ float KD_TREE<PointType>::calc_dist(PointType a, PointType b)
 }
 
 template <typename PointType>
-float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE *node, PointType point)
+float KD_TREE<PointType>::calc_dist(const PointType &a, const Node_XYZ &b)
+{
+    return (a.x - b.x) * (a.x - b.x) + (a.y - b.y) * (a.y - b.y) + (a.z - b.z) * (a.z - b.z);
+}
+
+template <typename PointType>
+float KD_TREE<PointType>::calc_box_dist(KD_TREE_NODE *node, const PointType &point)
 {
     if (node == nullptr)
         return INFINITY;
@@ -1725,4 +2308,5 @@ bool KD_TREE<PointType>::point_cmp_z(PointType a, PointType b) { return a.z < b.
 template class KD_TREE<pcl::PointXYZ>;
 template class KD_TREE<pcl::PointXYZI>;
 template class KD_TREE<pcl::PointXYZINormal>;
+template class KD_TREE<ikdTree_PointType>;
 
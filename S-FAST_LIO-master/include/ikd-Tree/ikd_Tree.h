@@ -1,21 +1,38 @@
 #pragma once
 #include <stdio.h>
 #include <queue>
+#include <deque>
 #include <pthread.h>
+#include <atomic>
 #include <chrono>
 #include <time.h>
 #include <unistd.h>
 #include <math.h>
 #include <algorithm>
 #include <memory.h>
+#include <stdint.h>
+#include <new>
+#include <vector>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <pcl/point_types.h>
 
 #define EPSS 1e-6
 #define Minimal_Unbalanced_Tree_Size 10
 #define Multi_Thread_Rebuild_Point_Num 1500
+#define Rebuild_Thread_Num 2
+#define Max_Rebuild_Thread_Num 8
 #define DOWNSAMPLE_SWITCH true
 #define ForceRebuildPercentage 0.2
-#define Q_LEN 1000000
+#define Rebuild_Logger_Segment_Len 4096
+#define Rebuild_Logger_Soft_Cap 200000
+#define Node_Pool_Slab_Size 4096
+#define Search_Reader_Slot_Num 64
+#define Parallel_Build_Depth 4
+#define Parallel_Build_Min_Size 50000
+#define Snapshot_Version 1
 
 using namespace std;
 
@@ -28,6 +45,12 @@ struct BoxPointType
     float vertex_max[3];
 };
 
+// Compact map point: position and intensity only, 16 bytes instead of 48 for pcl::PointXYZINormal
+struct ikdTree_PointType
+{
+    float x = 0.0f, y = 0.0f, z = 0.0f, intensity = 0.0f;
+};
+
 enum operation_set
 {
     ADD_POINT,
@@ -56,26 +79,33 @@ public:
     using PointVector = std::vector<PointType, Eigen::aligned_allocator<PointType>>;
     using Ptr = std::shared_ptr<KD_TREE<PointType>>;
     
+    struct Node_XYZ
+    {
+        float x, y, z;
+    };
+
     struct KD_TREE_NODE
     {
-        PointType point;
-        int division_axis;
-        int TreeSize = 1;
-        int invalid_point_num = 0;
-        int down_del_num = 0;
+        // Hot part: everything Search reads while descending, kept within the first 64 bytes
+        Node_XYZ point;
+        float node_range_x[2], node_range_y[2], node_range_z[2];
+        uint8_t division_axis;
         bool point_deleted = false;
         bool tree_deleted = false;
-        bool point_downsample_deleted = false;
-        bool tree_downsample_deleted = false;
         bool need_push_down_to_left = false;
         bool need_push_down_to_right = false;
+        bool point_downsample_deleted = false;
+        bool tree_downsample_deleted = false;
         bool working_flag = false;
-        pthread_mutex_t push_down_mutex_lock;
-        float node_range_x[2], node_range_y[2], node_range_z[2];
-        float radius_sq;
         KD_TREE_NODE *left_son_ptr = nullptr;
         KD_TREE_NODE *right_son_ptr = nullptr;
+        // Cold part
         KD_TREE_NODE *father_ptr = nullptr;
+        PointType *payload = nullptr; // full point (intensity, normal, curvature...) in the pool's side array
+        int TreeSize = 1;
+        int invalid_point_num = 0;
+        int down_del_num = 0;
+        float radius_sq;
         // For paper data record
         float alpha_del;
         float alpha_bal;
@@ -200,77 +230,327 @@ public:
         int cap = 0;
     };
 
+    // Flat result buffer of Nearest_Search_Batch. Keep one instance alive across calls so its storage is reused.
+    struct Batch_Search_Result
+    {
+        int k = 0;
+        PointVector points;                // neighbours of query i: points[i * k] ... points[i * k + num[i] - 1], nearest first
+        vector<float> dists;               // squared distances, same layout as points
+        vector<int> num;                   // number of neighbours found for each query (<= k), 0 if rejected early
+        int rejected = 0;                  // queries dropped once fewer than k points could lie within max_dist
+        vector<pair<uint64_t, int>> order; // scratch: queries sorted by Morton code
+    };
+
+    struct Node_Pool_Stats
+    {
+        size_t node_size = 0;   // bytes per KD_TREE_NODE
+        size_t payload_size = 0; // bytes per point in the payload side array
+        size_t slab_num = 0;    // slabs allocated from the heap
+        size_t capacity = 0;    // nodes held by the pool (in use + free)
+        size_t in_use = 0;      // nodes currently in the tree(s)
+        size_t total_alloc = 0; // nodes handed out since construction
+        size_t total_free = 0;  // nodes returned since construction
+        size_t memory = 0;      // bytes reserved by the slabs (nodes + payload)
+    };
+
+    struct Build_Stats
+    {
+        size_t points = 0;     // points passed to the last Build()
+        double time = 0;       // wall time of the last Build() (s)
+        double throughput = 0; // points / s
+    };
+
+    // Binary snapshot layout: header, PointType[node_num] and Snapshot_Node[node_num], both in pre-order.
+    // Links are node indices, so the file can be mapped at any address.
+    struct Snapshot_Header
+    {
+        char magic[8];         // "IKDTREE"
+        uint32_t version;      // Snapshot_Version
+        uint32_t point_size;   // sizeof(PointType)
+        uint32_t node_size;    // sizeof(Snapshot_Node)
+        uint32_t reserved;
+        uint64_t node_num;
+        uint64_t point_offset; // byte offset of the points
+        uint64_t node_offset;  // byte offset of the node records
+    };
+
+    struct Snapshot_Node
+    {
+        int32_t left, right;   // child index, -1 if none
+        uint8_t division_axis;
+        uint8_t flags;         // 1: point_deleted, 2: point_downsample_deleted
+        uint8_t reserved[2];
+    };
+
+    struct Rebuild_Logger_Stats
+    {
+        int size = 0;                  // operations currently waiting for the rebuild thread
+        int peak = 0;                  // largest log length since construction
+        int soft_cap = 0;              // producers wait once the log reaches this length
+        size_t memory = 0;             // bytes reserved by the log segments
+        size_t backpressure_waits = 0; // update calls that had to wait for the rebuild thread
+        double backpressure_time = 0;  // total time spent waiting (s)
+    };
+
+    // Counters kept on the hot paths since construction. They are plain increments (relaxed atomics for
+    // searches), so they can stay on; tree_stats() only copies them and adds the memory footprint.
+    struct Tree_Stats
+    {
+        size_t searches = 0;                // kNN queries
+        size_t nodes_visited = 0;           // nodes entered by those queries
+        size_t search_rejected = 0;         // queries dropped early by the max_dist bound
+        size_t reader_retries = 0;          // Search_Enter retries after an epoch flip (searches never take a lock)
+        size_t add_requests = 0;            // points passed to Add_Points
+        size_t points_inserted = 0;         // of those, inserted into the tree
+        size_t downsample_rejected = 0;     // of those, dropped because their downsample box kept a closer point
+        size_t delete_requests = 0;         // points and boxes passed to Delete_Points / Delete_Point_Boxes
+        size_t box_deleted = 0;             // points removed by Delete_Point_Boxes
+        size_t sync_rebuilds = 0;           // subtrees rebuilt on the updating thread
+        double sync_rebuild_time = 0;       // (s)
+        size_t background_rebuilds = 0;     // subtrees rebuilt by the rebuild threads
+        double background_rebuild_time = 0; // flatten to publish (s)
+        size_t lock_waits = 0;              // updates that found their subtree locked by a rebuild thread
+        double lock_wait_time = 0;          // time spent waiting for it (s)
+        size_t memory = 0;                  // node pool, rebuild logs and scratch storage (bytes)
+    };
+
+    // Slab allocator for tree nodes. Nodes are handed out and returned in batches
+    // (one BuildTree call / one deleted subtree) under a single lock; slabs are only
+    // returned to the heap when the tree is destroyed. Each node slab has a parallel
+    // payload slab holding the full points, so the nodes themselves stay small.
+    class NODE_POOL
+    {
+    public:
+        NODE_POOL()
+        {
+            pthread_mutex_init(&pool_mutex_lock, NULL);
+        }
+        ~NODE_POOL()
+        {
+            for (KD_TREE_NODE *slab : slabs)
+                delete[] slab;
+            for (PointType *slab : payload_slabs)
+                delete[] slab;
+            pthread_mutex_destroy(&pool_mutex_lock);
+        }
+        void alloc(int n, KD_TREE_NODE **nodes)
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            while (int(free_nodes.size()) < n)
+                add_slab();
+            for (int i = 0; i < n; i++)
+            {
+                nodes[i] = free_nodes.back();
+                free_nodes.pop_back();
+            }
+            total_alloc += n;
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+        void release(KD_TREE_NODE *const *nodes, int n)
+        {
+            pthread_mutex_lock(&pool_mutex_lock);
+            free_nodes.insert(free_nodes.end(), nodes, nodes + n);
+            total_free += n;
+            pthread_mutex_unlock(&pool_mutex_lock);
+        }
+        Node_Pool_Stats stats()
+        {
+            Node_Pool_Stats st;
+            pthread_mutex_lock(&pool_mutex_lock);
+            st.node_size = sizeof(KD_TREE_NODE);
+            st.payload_size = sizeof(PointType);
+            st.slab_num = slabs.size();
+            st.capacity = slabs.size() * Node_Pool_Slab_Size;
+            st.in_use = st.capacity - free_nodes.size();
+            st.total_alloc = total_alloc;
+            st.total_free = total_free;
+            st.memory = st.capacity * (sizeof(KD_TREE_NODE) + sizeof(PointType));
+            pthread_mutex_unlock(&pool_mutex_lock);
+            return st;
+        }
+
+    private:
+        void add_slab()
+        {
+            KD_TREE_NODE *slab = new KD_TREE_NODE[Node_Pool_Slab_Size];
+            PointType *payload_slab = new PointType[Node_Pool_Slab_Size];
+            slabs.push_back(slab);
+            payload_slabs.push_back(payload_slab);
+            for (int i = Node_Pool_Slab_Size - 1; i >= 0; i--)
+            {
+                slab[i].payload = payload_slab + i;
+                free_nodes.push_back(slab + i);
+            }
+        }
+        pthread_mutex_t pool_mutex_lock;
+        vector<KD_TREE_NODE *> slabs;
+        vector<PointType *> payload_slabs;
+        vector<KD_TREE_NODE *> free_nodes;
+        size_t total_alloc = 0, total_free = 0;
+    };
+
+    // Growable FIFO of the operations blocked by a rebuild. Storage is allocated in segments of
+    // Rebuild_Logger_Segment_Len entries on demand and released once drained (one spare segment is kept),
+    // so an idle tree holds no log memory and a long rebuild is no longer limited to a fixed length.
     class MANUAL_Q
     {
     private:
-        int head = 0, tail = 0, counter = 0;
-        Operation_Logger_Type q[Q_LEN];
-        bool is_empty;
+        int head = 0, tail = 0, counter = 0; // head: index in the front segment, tail: next free index in the back segment
+        std::deque<Operation_Logger_Type *> segments;
+        Operation_Logger_Type *spare_segment = nullptr;
+
+        void recycle(Operation_Logger_Type *segment)
+        {
+            if (spare_segment == nullptr)
+                spare_segment = segment;
+            else
+                delete[] segment;
+        }
 
     public:
+        MANUAL_Q() = default;
+        MANUAL_Q(const MANUAL_Q &) = delete;
+        MANUAL_Q &operator=(const MANUAL_Q &) = delete;
+        ~MANUAL_Q()
+        {
+            clear();
+            delete[] spare_segment;
+        }
         void pop()
         {
             if (counter == 0)
                 return;
             head++;
-            head %= Q_LEN;
             counter--;
             if (counter == 0)
-                is_empty = true;
+            {
+                clear();
+            }
+            else if (head == Rebuild_Logger_Segment_Len)
+            {
+                recycle(segments.front());
+                segments.pop_front();
+                head = 0;
+            }
             return;
         }
         Operation_Logger_Type front()
         {
-            return q[head];
+            return segments.front()[head];
         }
         Operation_Logger_Type back()
         {
-            return q[tail];
+            return segments.back()[tail - 1];
         }
         void clear()
         {
+            for (Operation_Logger_Type *segment : segments)
+                recycle(segment);
+            segments.clear();
             head = 0;
             tail = 0;
             counter = 0;
-            is_empty = true;
             return;
         }
-        void push(Operation_Logger_Type op)
+        void push(const Operation_Logger_Type &op)
         {
-            q[tail] = op;
+            if (segments.empty() || tail == Rebuild_Logger_Segment_Len)
+            {
+                if (spare_segment != nullptr)
+                {
+                    segments.push_back(spare_segment);
+                    spare_segment = nullptr;
+                }
+                else
+                {
+                    segments.push_back(new Operation_Logger_Type[Rebuild_Logger_Segment_Len]);
+                }
+                tail = 0;
+            }
+            segments.back()[tail++] = op;
             counter++;
-            if (is_empty)
-                is_empty = false;
-            tail++;
-            tail %= Q_LEN;
         }
         bool empty()
         {
-            return is_empty;
+            return counter == 0;
         }
         int size()
         {
             return counter;
         }
+        size_t memory()
+        {
+            return (segments.size() + (spare_segment != nullptr)) * Rebuild_Logger_Segment_Len * sizeof(Operation_Logger_Type);
+        }
+    };
+
+    // One background rebuild slot, served by its own thread. Rebuild_Ptr is the subtree waiting for
+    // (or under) rebuild; operations reaching it while rebuild_flag is set go to its own log.
+    struct Rebuild_Task
+    {
+        KD_TREE *tree = nullptr;
+        KD_TREE_NODE **Rebuild_Ptr = nullptr;
+        KD_TREE_NODE *Rebuild_Root = nullptr; // *Rebuild_Ptr when scheduled, kept until the slot is released
+        bool rebuild_flag = false;
+        pthread_t rebuild_thread;
+        pthread_mutex_t working_flag_mutex, rebuild_logger_mutex_lock;
+        MANUAL_Q Rebuild_Logger;
+        PointVector Rebuild_PCL_Storage;
     };
 
 private:
     // Multi-thread Tree Rebuild
     bool termination_flag = false;
-    bool rebuild_flag = false;
-    pthread_t rebuild_thread;
-    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, working_flag_mutex, search_flag_mutex;
-    pthread_mutex_t rebuild_logger_mutex_lock, points_deleted_rebuild_mutex_lock;
-    // queue<Operation_Logger_Type> Rebuild_Logger;
-    MANUAL_Q Rebuild_Logger;
-    PointVector Rebuild_PCL_Storage;
-    KD_TREE_NODE **Rebuild_Ptr = nullptr;
-    int search_mutex_counter = 0;
+    pthread_mutex_t termination_flag_mutex_lock, rebuild_ptr_mutex_lock, search_sync_mutex;
+    pthread_mutex_t points_deleted_rebuild_mutex_lock;
+    // Serializes changes above the subtrees under rebuild: the updating thread holds it for each operation,
+    // a rebuild thread for publishing its subtree and refreshing the ancestors. Taken before working_flag_mutex.
+    pthread_mutex_t tree_update_mutex_lock;
+    // Subtrees scheduled on different slots are always disjoint
+    Rebuild_Task Rebuild_Tasks[Max_Rebuild_Thread_Num];
+    int rebuild_thread_num = Rebuild_Thread_Num;
+    int multi_thread_rebuild_point_num = Multi_Thread_Rebuild_Point_Num;
+    int rebuild_logger_soft_cap = Rebuild_Logger_Soft_Cap;
+    int build_parallel_depth = Parallel_Build_Depth;
+    Build_Stats last_build;
+    size_t backpressure_waits = 0;
+    double backpressure_time = 0;
+    // Hot-path counters, see Tree_Stats. The background ones are guarded by rebuild_ptr_mutex_lock,
+    // the others are only written by the updating thread.
+    atomic<size_t> search_count{0}, search_visited{0}, search_rejected{0}, reader_retries{0};
+    size_t add_requests = 0, points_inserted = 0, downsample_rejected = 0;
+    size_t delete_requests = 0, box_deleted = 0;
+    size_t sync_rebuilds = 0, background_rebuilds = 0, lock_waits = 0;
+    double sync_rebuild_time = 0, background_rebuild_time = 0, lock_wait_time = 0;
+    NODE_POOL Node_Pool;
+    // Readers only announce themselves in a per-thread slot (one cache line each) under the current epoch
+    // parity. Writers publish new subtrees with a release store and free the nodes they replaced only after
+    // the readers of the old parity are gone: the rebuild threads wait for them (Search_Synchronize), the
+    // updating thread queues its retired subtrees and frees them once that happened (Reclaim_Retired).
+    struct Search_Reader_Slot
+    {
+        atomic<int> active[2];
+        char padding[64 - 2 * sizeof(atomic<int>)];
+    };
+    Search_Reader_Slot Search_Readers[Search_Reader_Slot_Num];
+    atomic<int> search_epoch;
+    vector<KD_TREE_NODE *> Retired_Roots, Retiring_Roots;
+    int retiring_parity = 0;
+    int Search_Enter();
+    void Search_Exit(int reader);
+    void Search_Synchronize();
+    void Reclaim_Retired();
     static void *multi_thread_ptr(void *arg);
-    void multi_thread_rebuild();
+    void multi_thread_rebuild(Rebuild_Task &task);
+    Rebuild_Task *Rebuild_Target(KD_TREE_NODE *node);
+    void Cancel_Rebuild(KD_TREE_NODE *node);
     void start_thread();
     void stop_thread();
     void run_operation(KD_TREE_NODE **root, Operation_Logger_Type operation);
+    void Rebuild_Logger_Backpressure();
+    void Wait_For_Rebuilds();
+    void Lock_Working_Flag(Rebuild_Task *task);
+    void Depth_Histogram(KD_TREE_NODE *root, int depth, vector<int> &histogram);
     // KD Tree Functions and augmented variables
     int Treesize_tmp = 0, Validnum_tmp = 0;
     float alpha_bal_tmp = 0.5, alpha_del_tmp = 0.0;
@@ -283,24 +563,34 @@ private:
     PointVector Downsample_Storage;
     PointVector Multithread_Points_deleted;
     void InitTreeNode(KD_TREE_NODE *root);
+    KD_TREE_NODE *New_Tree_Node();
+    void Set_Node_Point(KD_TREE_NODE *node, const PointType &point);
+    void Collect_Tree_Nodes(KD_TREE_NODE *root, vector<KD_TREE_NODE *> &nodes);
+    int32_t Snapshot_Collect(KD_TREE_NODE *root, vector<Snapshot_Node> &records, FILE *fp);
     void Test_Lock_States(KD_TREE_NODE *root);
-    void BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage);
+    void BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, int parallel_depth = 0);
+    void BuildTree(KD_TREE_NODE **root, int l, int r, PointVector &Storage, KD_TREE_NODE **nodes, int parallel_depth = 0);
     void Rebuild(KD_TREE_NODE **root);
     int Delete_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild, bool is_downsample);
     void Delete_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild);
     void Add_by_point(KD_TREE_NODE **root, PointType point, bool allow_rebuild, int father_axis);
     void Add_by_range(KD_TREE_NODE **root, BoxPointType boxpoint, bool allow_rebuild);
-    void Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist); //priority_queue<PointType_CMP>
-    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage);
-    void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage);
+    bool Search(KD_TREE_NODE *root, int k_nearest, PointType point, MANUAL_HEAP &q, float max_dist, size_t &visited, int lazy_tag = 0, int pending = 0); //priority_queue<PointType_CMP>
+    int valid_upper_bound(KD_TREE_NODE *node, int lazy_tag);
+    static void Lazy_Flags(KD_TREE_NODE *root, int lazy_tag, bool &tree_downsample_deleted, bool &tree_deleted, bool &point_deleted);
+    void Search_by_range(KD_TREE_NODE *root, BoxPointType boxpoint, PointVector &Storage, int lazy_tag = 0);
+    void Search_by_radius(KD_TREE_NODE *root, PointType point, float radius, PointVector &Storage, int lazy_tag = 0);
+    void Collect_Valid(KD_TREE_NODE *root, PointVector &Storage, int lazy_tag);
+    void Flatten_Rebuild(KD_TREE_NODE *root, PointVector &Storage, int lazy_tag);
     bool Criterion_Check(KD_TREE_NODE *root);
     void Push_Down(KD_TREE_NODE *root);
     void Update(KD_TREE_NODE *root);
     void delete_tree_nodes(KD_TREE_NODE **root);
     void downsample(KD_TREE_NODE **root);
     bool same_point(PointType a, PointType b);
-    float calc_dist(PointType a, PointType b);
-    float calc_box_dist(KD_TREE_NODE *node, PointType point);
+    float calc_dist(const PointType &a, const PointType &b);
+    float calc_dist(const PointType &a, const Node_XYZ &b);
+    float calc_box_dist(KD_TREE_NODE *node, const PointType &point);
     static bool point_cmp_x(PointType a, PointType b);
     static bool point_cmp_y(PointType a, PointType b);
     static bool point_cmp_z(PointType a, PointType b);
@@ -320,12 +610,28 @@ public:
     {
         downsample_size = downsample_param;
     }
+    void set_rebuild_logger_soft_cap(int soft_cap)
+    {
+        rebuild_logger_soft_cap = soft_cap;
+    }
+    void set_multi_thread_rebuild_point_num(int point_num)
+    {
+        multi_thread_rebuild_point_num = point_num;
+    }
+    void set_rebuild_thread_num(int thread_num);
+    void set_build_parallel_depth(int depth)
+    {
+        build_parallel_depth = depth;
+    }
     void InitializeKDTree(float delete_param = 0.5, float balance_param = 0.7, float box_length = 0.2);
     int size();
     int validnum();
     void root_alpha(float &alpha_bal, float &alpha_del);
     void Build(PointVector point_cloud);
+    bool save_snapshot(const string &path);
+    bool load_snapshot(const string &path);
     void Nearest_Search(PointType point, int k_nearest, PointVector &Nearest_Points, vector<float> &Point_Distance, float max_dist = INFINITY);
+    void Nearest_Search_Batch(const PointVector &points, int k_nearest, Batch_Search_Result &result, float max_dist = INFINITY);
     void Box_Search(const BoxPointType &Box_of_Point, PointVector &Storage);
     void Radius_Search(PointType point, const float radius, PointVector &Storage);
     int Add_Points(PointVector &PointToAdd, bool downsample_on);
@@ -335,7 +641,18 @@ public:
     void flatten(KD_TREE_NODE *root, PointVector &Storage, delete_point_storage_set storage_type);
     void acquire_removed_points(PointVector &removed_points);
     BoxPointType tree_range();
+    Node_Pool_Stats node_pool_stats();
+    Rebuild_Logger_Stats rebuild_logger_stats();
+    Tree_Stats tree_stats();
+    // Number of nodes at each depth (root = 0). Walks the whole tree, so sample it less often than tree_stats()
+    void depth_histogram(vector<int> &histogram);
+    Build_Stats build_stats()
+    {
+        return last_build;
+    }
     PointVector PCL_Storage;
+    // Swapped by the rebuild threads (release store). Readers take one __atomic_load_n(..., __ATOMIC_ACQUIRE) per call,
+    // writers access it under tree_update_mutex_lock
     KD_TREE_NODE *Root_Node = nullptr;
     int max_queue_size = 0;
 };
@@ -0,0 +1,602 @@
+#ifndef LOCAL_MAP_HPP
+#define LOCAL_MAP_HPP
+
+#include <cmath>
+#include <list>
+#include <vector>
+#include <iterator>
+#include <algorithm>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <Eigen/Core>
+
+#include "common_lib.h"
+#include <ikd-Tree/ikd_Tree.h>
+
+//局部地图的抽象接口，laserMapping和ESKF只通过它访问地图
+class local_map
+{
+public:
+	typedef KD_TREE<MapPointType>::Batch_Search_Result batch_result;
+
+	virtual ~local_map() {}
+	virtual const char *name() const = 0;
+	virtual void set_downsample_size(float size) = 0; //加点时降采样体素的大小(filter_size_map)
+	virtual bool empty() = 0;
+	virtual int size() = 0;
+	virtual void build(MapPointVector &points) = 0;							 //用第一帧点云初始化地图
+	virtual int add_points(MapPointVector &points, bool downsample_on) = 0; //downsample_on: 每个降采样体素只保留离体素中心最近的点
+	virtual int delete_boxes(vector<BoxPointType> &boxes) = 0;				 //删除长方体内的点，返回删除的点数
+	//局部地图移动时删除移出的区域，是近似删除: 后端可以按自己的区块粒度删除，被删的点可能在boxes之外(仍在局部地图内)，
+	//也可能有boxes内的点留下。evicted返回实际删除的区域(依赖地图内容的缓存应按它失效)，返回值是实际删除的点数。
+	//默认与delete_boxes相同(精确删除，evicted即boxes)
+	virtual int evict_boxes(vector<BoxPointType> &boxes, vector<BoxPointType> &evicted)
+	{
+		evicted = boxes;
+		return delete_boxes(boxes);
+	}
+	//批量kNN，每个点的近邻按距离从小到大排列，只保留距离不超过max_dist的近邻
+	//max_dist有限时，能确定max_dist内不足k个点的查询提前放弃(num为0)，放弃的次数记在result.rejected
+	virtual void nearest_search_batch(const MapPointVector &points, int k, batch_result &result, float max_dist = INFINITY) = 0;
+	virtual void nearest_search(const MapPointType &point, int k, MapPointVector &points_near, vector<float> &dists, float max_dist = INFINITY) = 0;
+	virtual void radius_search(const MapPointType &point, float radius, MapPointVector &points) = 0;
+	virtual void get_points(MapPointVector &points) = 0; //地图中所有的点(用于发布和保存)
+};
+
+//ikd-Tree后端
+class ikd_tree_map : public local_map
+{
+public:
+	explicit ikd_tree_map(KD_TREE<MapPointType> &tree) : tree_(tree) {}
+
+	const char *name() const { return "ikdtree"; }
+	void set_downsample_size(float size) { tree_.set_downsample_param(size); }
+	bool empty() { return __atomic_load_n(&tree_.Root_Node, __ATOMIC_ACQUIRE) == nullptr; } //根节点可能被重建线程替换
+	int size() { return tree_.validnum(); } //不含已删除的点
+	void build(MapPointVector &points) { tree_.Build(points); }
+	int add_points(MapPointVector &points, bool downsample_on) { return tree_.Add_Points(points, downsample_on); }
+	int delete_boxes(vector<BoxPointType> &boxes) { return tree_.Delete_Point_Boxes(boxes); }
+
+	void nearest_search_batch(const MapPointVector &points, int k, batch_result &result, float max_dist = INFINITY)
+	{
+		tree_.Nearest_Search_Batch(points, k, result, max_dist);
+	}
+
+	void nearest_search(const MapPointType &point, int k, MapPointVector &points_near, vector<float> &dists, float max_dist = INFINITY)
+	{
+		tree_.Nearest_Search(point, k, points_near, dists, max_dist);
+	}
+
+	void radius_search(const MapPointType &point, float radius, MapPointVector &points) { tree_.Radius_Search(point, radius, points); }
+
+	//flatten会下放lazy标记且不登记为读者，重建线程可能同时释放节点；这里用覆盖整个空间的Box_Search只读地取出所有点
+	void get_points(MapPointVector &points)
+	{
+		BoxPointType all;
+		for (int i = 0; i < 3; i++)
+		{
+			all.vertex_min[i] = -INFINITY;
+			all.vertex_max[i] = INFINITY;
+		}
+		tree_.Box_Search(all, points);
+	}
+
+	KD_TREE<MapPointType> &tree() { return tree_; }
+
+private:
+	KD_TREE<MapPointType> &tree_;
+};
+
+//增量哈希体素地图(类似iVox): 点按resolution大小的体素存放在哈希表中，kNN只搜索周围7/19/27个体素，
+//查找近邻的代价与地图大小无关。体素按所在的固定世界区块(tile)分组，整个区块可以O(1)地从地图中摘下，
+//摘下的区块交给后台线程释放。区块按最近一次加点的时间排成LRU，体素数量超过capacity时丢弃最久未更新的区块。
+//近邻只在周围体素中查找，距离超过约一个resolution的近邻可能找不到(ESKF只用较近的近邻，不受影响)
+class voxel_map : public local_map
+{
+public:
+	voxel_map()
+	{
+		set_param(0.5f, 19, 1000000, 50.0f);
+	}
+
+	~voxel_map()
+	{
+		{
+			std::lock_guard<std::mutex> lock(free_mutex_);
+			free_stop_ = true;
+		}
+		free_cv_.notify_one();
+		if (free_thread_.joinable())
+			free_thread_.join();
+	}
+
+	void set_param(float resolution, int nearby_type, int capacity, float tile_size)
+	{
+		resolution_ = resolution;
+		inv_resolution_ = 1.0f / resolution;
+		capacity_ = max(capacity, 1);
+		tile_voxels_ = max(int(round(tile_size / resolution)), 1);
+		nearby_.clear();
+		for (int x = -1; x <= 1; x++)
+			for (int y = -1; y <= 1; y++)
+				for (int z = -1; z <= 1; z++)
+				{
+					int manhattan = abs(x) + abs(y) + abs(z);
+					if ((nearby_type == 7 && manhattan <= 1) || (nearby_type == 19 && manhattan <= 2) || nearby_type == 27)
+						nearby_.push_back(Eigen::Vector3i(x, y, z));
+				}
+		//中心体素放在最前面
+		std::stable_sort(nearby_.begin(), nearby_.end(), [](const Eigen::Vector3i &a, const Eigen::Vector3i &b)
+						 { return a.cwiseAbs().sum() < b.cwiseAbs().sum(); });
+		clear();
+	}
+
+	const char *name() const { return "ivox"; }
+	void set_downsample_size(float size) { downsample_size_ = size; } //只在新点所在的体素中降采样，resolution应为size的整数倍
+	bool empty() { return point_num_ == 0; }
+	int size() { return point_num_; }
+
+	void clear()
+	{
+		tiles_.clear();
+		lru_.clear();
+		point_num_ = 0;
+		voxel_num_ = 0;
+	}
+
+	void build(MapPointVector &points)
+	{
+		clear();
+		add_points(points, false);
+	}
+
+	int add_points(MapPointVector &points, bool downsample_on)
+	{
+		int added = 0;
+		tile *t = nullptr;
+		int64_t t_key = -1;
+		for (const MapPointType &p : points)
+		{
+			voxel &v = touch(coord(p), t, t_key);
+			if (downsample_on && downsample_size_ > 0)
+			{
+				//与ikdtree相同: 降采样体素中的点(包括新点)只保留离体素中心最近的一个
+				Eigen::Vector3f lo(floor(p.x / downsample_size_) * downsample_size_, floor(p.y / downsample_size_) * downsample_size_,
+								   floor(p.z / downsample_size_) * downsample_size_);
+				Eigen::Vector3f hi = lo + Eigen::Vector3f::Constant(downsample_size_);
+				Eigen::Vector3f mid = (lo + hi) / 2;
+				MapPointType best = p;
+				float best_dist = sq_dist(p, mid(0), mid(1), mid(2));
+				int in_box = 0;
+				for (size_t i = 0; i < v.points.size();)
+				{
+					const MapPointType &q = v.points[i];
+					if (q.x < lo(0) || q.x >= hi(0) || q.y < lo(1) || q.y >= hi(1) || q.z < lo(2) || q.z >= hi(2))
+					{
+						i++;
+						continue;
+					}
+					in_box++;
+					float dist = sq_dist(q, mid(0), mid(1), mid(2));
+					if (dist < best_dist)
+					{
+						best_dist = dist;
+						best = q;
+					}
+					v.points[i] = v.points.back();
+					v.points.pop_back();
+				}
+				v.points.push_back(best);
+				t->point_num += 1 - in_box;
+				point_num_ += 1 - in_box;
+				if (in_box == 0)
+					added++;
+				continue;
+			}
+			v.points.push_back(p);
+			t->point_num++;
+			point_num_++;
+			added++;
+		}
+		evict();
+		return added;
+	}
+
+	//精确删除长方体内的点: 整个落在长方体内的区块直接摘下，只有跨边界的区块逐个体素删点
+	int delete_boxes(vector<BoxPointType> &boxes)
+	{
+		int deleted = 0;
+		vector<tile_hit> hits;
+		for (const BoxPointType &box : boxes)
+		{
+			tiles_in_box(box, hits);
+			for (const tile_hit &h : hits)
+			{
+				if (box_contains(box, h.second))
+				{
+					deleted += detach(h.first);
+					continue;
+				}
+				tile &t = *h.first->second;
+				for (auto it = t.grids.begin(); it != t.grids.end();)
+				{
+					auto next = std::next(it);
+					deleted += delete_in_box(t, it, box);
+					it = next;
+				}
+				if (t.grids.empty())
+					detach(h.first);
+			}
+		}
+		return deleted;
+	}
+
+	//按区块近似删除: 中心在长方体内的区块整块摘下，不逐点判断，代价只与区块数有关。
+	//跨边界的区块会带走局部地图内的点(下一帧重新加入)，evicted返回摘下区块的范围
+	int evict_boxes(vector<BoxPointType> &boxes, vector<BoxPointType> &evicted)
+	{
+		int deleted = 0;
+		vector<tile_hit> hits;
+		evicted.clear();
+		for (const BoxPointType &box : boxes)
+		{
+			tiles_in_box(box, hits);
+			for (const tile_hit &h : hits)
+			{
+				bool inside = true;
+				for (int a = 0; a < 3; a++)
+				{
+					float mid = (h.second.vertex_min[a] + h.second.vertex_max[a]) / 2;
+					inside = inside && mid >= box.vertex_min[a] && mid < box.vertex_max[a];
+				}
+				if (inside)
+				{
+					deleted += detach(h.first);
+					evicted.push_back(h.second);
+				}
+			}
+		}
+		return deleted;
+	}
+
+	//只读，可以多线程同时调用(期间不能加点或删点)
+	void nearest_search_batch(const MapPointVector &points, int k, batch_result &result, float max_dist = INFINITY)
+	{
+		int n = points.size();
+		result.k = k;
+		if (result.points.size() < size_t(n) * k)
+		{
+			result.points.resize(size_t(n) * k);
+			result.dists.resize(size_t(n) * k);
+		}
+		if (result.num.size() < size_t(n))
+			result.num.resize(n);
+		int rejected = 0;
+#ifdef MP_EN
+#pragma omp parallel for num_threads(MP_PROC_NUM) schedule(static) reduction(+ : rejected)
+#endif
+		for (int i = 0; i < n; i++)
+		{
+			int num = knn(points[i], k, &result.points[size_t(i) * k], &result.dists[size_t(i) * k], max_dist);
+			rejected += num < 0;
+			result.num[i] = max(num, 0);
+		}
+		result.rejected = rejected;
+	}
+
+	void nearest_search(const MapPointType &point, int k, MapPointVector &points_near, vector<float> &dists, float max_dist = INFINITY)
+	{
+		points_near.resize(k);
+		dists.resize(k);
+		int num = max(knn(point, k, points_near.data(), dists.data(), max_dist), 0);
+		points_near.resize(num);
+		dists.resize(num);
+	}
+
+	void radius_search(const MapPointType &point, float radius, MapPointVector &points)
+	{
+		points.clear();
+		Eigen::Vector3i lo = coord(point.x - radius, point.y - radius, point.z - radius);
+		Eigen::Vector3i hi = coord(point.x + radius, point.y + radius, point.z + radius);
+		float radius_sq = radius * radius;
+		const tile *t = nullptr;
+		int64_t t_key = -1;
+		for (int x = lo(0); x <= hi(0); x++)
+			for (int y = lo(1); y <= hi(1); y++)
+				for (int z = lo(2); z <= hi(2); z++)
+				{
+					const voxel *v = find(Eigen::Vector3i(x, y, z), t, t_key);
+					if (v == nullptr)
+						continue;
+					for (const MapPointType &q : v->points)
+						if (sq_dist(q, point.x, point.y, point.z) <= radius_sq)
+							points.push_back(q);
+				}
+	}
+
+	void get_points(MapPointVector &points)
+	{
+		points.clear();
+		points.reserve(point_num_);
+		for (const auto &t : tiles_)
+			for (const auto &g : t.second->grids)
+				points.insert(points.end(), g.second.points.begin(), g.second.points.end());
+	}
+
+	size_t voxel_num() const { return voxel_num_; }
+	size_t tile_num() const { return tiles_.size(); }
+
+private:
+	struct voxel
+	{
+		MapPointVector points;
+	};
+	typedef std::unordered_map<int64_t, voxel> grid_map;
+
+	struct tile
+	{
+		grid_map grids;
+		size_t point_num = 0;
+		std::list<int64_t>::iterator lru; //在lru_中的位置
+	};
+	typedef std::unordered_map<int64_t, std::unique_ptr<tile>> tile_map;
+	typedef std::pair<tile_map::iterator, BoxPointType> tile_hit;
+
+	static constexpr int64_t OFFSET = int64_t(1) << 20;
+	static constexpr int64_t MASK = (int64_t(1) << 21) - 1;
+
+	static float sq_dist(const MapPointType &p, float x, float y, float z)
+	{
+		return (p.x - x) * (p.x - x) + (p.y - y) * (p.y - y) + (p.z - z) * (p.z - z);
+	}
+
+	static bool box_contains(const BoxPointType &outer, const BoxPointType &inner)
+	{
+		for (int a = 0; a < 3; a++)
+			if (inner.vertex_min[a] < outer.vertex_min[a] || inner.vertex_max[a] > outer.vertex_max[a])
+				return false;
+		return true;
+	}
+
+	Eigen::Vector3i coord(float x, float y, float z) const
+	{
+		return Eigen::Vector3i(int(floor(x * inv_resolution_)), int(floor(y * inv_resolution_)), int(floor(z * inv_resolution_)));
+	}
+
+	Eigen::Vector3i coord(const MapPointType &p) const { return coord(p.x, p.y, p.z); }
+
+	//体素坐标所在的区块坐标(向下取整)
+	Eigen::Vector3i tile_coord(const Eigen::Vector3i &c) const
+	{
+		Eigen::Vector3i t;
+		for (int a = 0; a < 3; a++)
+			t(a) = c(a) >= 0 ? c(a) / tile_voxels_ : -((-c(a) - 1) / tile_voxels_) - 1;
+		return t;
+	}
+
+	//体素或区块的key，每个方向21位
+	static int64_t key(const Eigen::Vector3i &c)
+	{
+		return ((c(0) + OFFSET) & MASK) | (((c(1) + OFFSET) & MASK) << 21) | (((c(2) + OFFSET) & MASK) << 42);
+	}
+
+	//查找体素，t/t_key缓存上一次用到的区块(相邻体素大多在同一个区块)
+	const voxel *find(const Eigen::Vector3i &c, const tile *&t, int64_t &t_key) const
+	{
+		int64_t k = key(tile_coord(c));
+		if (k != t_key)
+		{
+			auto it = tiles_.find(k);
+			t = it == tiles_.end() ? nullptr : it->second.get();
+			t_key = k;
+		}
+		if (t == nullptr)
+			return nullptr;
+		auto it = t->grids.find(key(c));
+		return it == t->grids.end() ? nullptr : &it->second;
+	}
+
+	//取出(或新建)体素，并把所在区块移到LRU的最前面
+	voxel &touch(const Eigen::Vector3i &c, tile *&t, int64_t &t_key)
+	{
+		int64_t k = key(tile_coord(c));
+		if (k != t_key)
+		{
+			std::unique_ptr<tile> &slot = tiles_[k];
+			if (!slot)
+			{
+				slot.reset(new tile);
+				lru_.push_front(k);
+				slot->lru = lru_.begin();
+			}
+			else
+				lru_.splice(lru_.begin(), lru_, slot->lru);
+			t = slot.get();
+			t_key = k;
+		}
+		auto res = t->grids.emplace(key(c), voxel());
+		voxel_num_ += res.second;
+		return res.first->second;
+	}
+
+	//找出与长方体相交的区块及其范围，摘下其中一个区块不影响其余的迭代器
+	void tiles_in_box(const BoxPointType &box, vector<tile_hit> &hits)
+	{
+		hits.clear();
+		Eigen::Vector3i lo = tile_coord(coord(box.vertex_min[0], box.vertex_min[1], box.vertex_min[2]));
+		Eigen::Vector3i hi = tile_coord(coord(box.vertex_max[0], box.vertex_max[1], box.vertex_max[2]));
+		Eigen::Vector3d span = (hi - lo).cast<double>() + Eigen::Vector3d::Ones();
+		if (span.prod() < double(tiles_.size()))
+		{
+			//长方体覆盖的区块比地图中的区块少时，只查找覆盖到的区块
+			for (int x = lo(0); x <= hi(0); x++)
+				for (int y = lo(1); y <= hi(1); y++)
+					for (int z = lo(2); z <= hi(2); z++)
+					{
+						Eigen::Vector3i tc(x, y, z);
+						auto it = tiles_.find(key(tc));
+						if (it != tiles_.end())
+							hits.push_back(tile_hit(it, tile_box(tc)));
+					}
+			return;
+		}
+		for (auto it = tiles_.begin(); it != tiles_.end(); it++)
+		{
+			//从key还原区块坐标
+			Eigen::Vector3i tc(int((it->first & MASK) - OFFSET), int(((it->first >> 21) & MASK) - OFFSET), int(((it->first >> 42) & MASK) - OFFSET));
+			if ((tc.array() >= lo.array()).all() && (tc.array() <= hi.array()).all())
+				hits.push_back(tile_hit(it, tile_box(tc)));
+		}
+	}
+
+	BoxPointType tile_box(const Eigen::Vector3i &tc) const
+	{
+		float tile_len = tile_voxels_ * resolution_;
+		BoxPointType box;
+		for (int a = 0; a < 3; a++)
+		{
+			box.vertex_min[a] = tc(a) * tile_len;
+			box.vertex_max[a] = box.vertex_min[a] + tile_len;
+		}
+		return box;
+	}
+
+	//删除体素中位于长方体内的点，体素空了就把它删掉
+	int delete_in_box(tile &t, grid_map::iterator it, const BoxPointType &box)
+	{
+		voxel &v = it->second;
+		auto end = std::remove_if(v.points.begin(), v.points.end(), [&box](const MapPointType &p)
+								  { return p.x >= box.vertex_min[0] && p.x < box.vertex_max[0] &&
+										   p.y >= box.vertex_min[1] && p.y < box.vertex_max[1] &&
+										   p.z >= box.vertex_min[2] && p.z < box.vertex_max[2]; });
+		int deleted = v.points.end() - end;
+		v.points.erase(end, v.points.end());
+		t.point_num -= deleted;
+		point_num_ -= deleted;
+		if (v.points.empty())
+		{
+			t.grids.erase(it);
+			voxel_num_--;
+		}
+		return deleted;
+	}
+
+	//把区块从地图中摘下(O(1))，内存交给后台线程释放，返回区块中的点数
+	int detach(tile_map::iterator it)
+	{
+		std::unique_ptr<tile> t = std::move(it->second);
+		tiles_.erase(it);
+		lru_.erase(t->lru);
+		point_num_ -= t->point_num;
+		voxel_num_ -= t->grids.size();
+		int num = t->point_num;
+		{
+			std::lock_guard<std::mutex> lock(free_mutex_);
+			free_queue_.push_back(std::move(t));
+			if (!free_thread_.joinable())
+				free_thread_ = std::thread(&voxel_map::free_loop, this);
+		}
+		free_cv_.notify_one();
+		return num;
+	}
+
+	void free_loop()
+	{
+		std::unique_lock<std::mutex> lock(free_mutex_);
+		while (true)
+		{
+			free_cv_.wait(lock, [this]
+						  { return free_stop_ || !free_queue_.empty(); });
+			if (free_queue_.empty())
+				return;
+			vector<std::unique_ptr<tile>> batch;
+			batch.swap(free_queue_);
+			lock.unlock();
+			batch.clear();
+			lock.lock();
+		}
+	}
+
+	//体素数量超过capacity时，丢弃最久没有加点的区块(至少保留最近更新的一个)
+	void evict()
+	{
+		while (voxel_num_ > size_t(capacity_) && lru_.size() > 1)
+			detach(tiles_.find(lru_.back()));
+	}
+
+	//在周围体素中找最近的k个点，按距离从小到大写入points/dists，返回找到的数量
+	//与max_dist球相交的体素中总共不足k个点时直接返回-1，不计算距离
+	int knn(const MapPointType &point, int k, MapPointType *points, float *dists, float max_dist) const
+	{
+		float max_dist_sq = max_dist * max_dist;
+		const MapPointVector *cand[27];
+		int cand_num = 0;
+		size_t total = 0;
+		Eigen::Vector3i c = coord(point);
+		const tile *t = nullptr;
+		int64_t t_key = -1;
+		for (const Eigen::Vector3i &d : nearby_)
+		{
+			Eigen::Vector3i cd = c + d;
+			const voxel *v = find(cd, t, t_key);
+			if (v == nullptr)
+				continue;
+			float box_dist = 0;
+			const float xyz[3] = {point.x, point.y, point.z};
+			for (int a = 0; a < 3; a++)
+			{
+				float lo = cd(a) * resolution_, hi = lo + resolution_;
+				float e = xyz[a] < lo ? lo - xyz[a] : xyz[a] > hi ? xyz[a] - hi : 0.f;
+				box_dist += e * e;
+			}
+			if (box_dist > max_dist_sq)
+				continue;
+			cand[cand_num++] = &v->points;
+			total += v->points.size();
+		}
+		if (max_dist < INFINITY && total < size_t(k))
+			return -1;
+
+		int num = 0;
+		for (int v = 0; v < cand_num; v++)
+		{
+			for (const MapPointType &q : *cand[v])
+			{
+				float dist = sq_dist(q, point.x, point.y, point.z);
+				if (dist > max_dist_sq || (num == k && dist >= dists[k - 1]))
+					continue;
+				//插入排序，k很小
+				int j = num < k ? num++ : k - 1;
+				for (; j > 0 && dists[j - 1] > dist; j--)
+				{
+					dists[j] = dists[j - 1];
+					points[j] = points[j - 1];
+				}
+				dists[j] = dist;
+				points[j] = q;
+			}
+		}
+		return num;
+	}
+
+	float resolution_ = 0.5f, inv_resolution_ = 2.0f;
+	float downsample_size_ = 0.5f;
+	int capacity_ = 1000000;
+	int tile_voxels_ = 100; //区块每个方向上的体素数
+	size_t point_num_ = 0, voxel_num_ = 0;
+	vector<Eigen::Vector3i> nearby_;
+	tile_map tiles_;
+	std::list<int64_t> lru_; //区块的LRU，最前面是最近加过点的区块
+
+	//后台释放摘下的区块
+	std::thread free_thread_;
+	std::mutex free_mutex_;
+	std::condition_variable free_cv_;
+	vector<std::unique_ptr<tile>> free_queue_;
+	bool free_stop_ = false;
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef PLANE_CACHE_HPP
+#define PLANE_CACHE_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <Eigen/Core>
+
+#include "common_lib.h"
+#include <ikd-Tree/ikd_Tree.h>
+
+//按地图体素缓存拟合好的平面，静态区域的点在后续帧中落入同一体素时直接复用，跳过esti_plane
+//地图在某个体素中增删点时(map_incremental / Delete_Point_Boxes)，该体素的缓存失效
+class plane_cache
+{
+public:
+	struct entry
+	{
+		float a, b, c, d; //平面方程 ax+by+cz+d=0，(a,b,c)为单位法向量
+		float quality;	  //拟合所用近邻点到平面的最大距离
+	};
+
+	void set_voxel_size(float voxel_size)
+	{
+		voxel_size_ = voxel_size;
+		map_.clear();
+	}
+
+	//点所在体素的key，每个方向21位
+	template <typename P>
+	int64_t key(const P &p) const
+	{
+		int64_t ix = int64_t(std::floor(p.x / voxel_size_)) + OFFSET;
+		int64_t iy = int64_t(std::floor(p.y / voxel_size_)) + OFFSET;
+		int64_t iz = int64_t(std::floor(p.z / voxel_size_)) + OFFSET;
+		return (ix & MASK) | ((iy & MASK) << 21) | ((iz & MASK) << 42);
+	}
+
+	//查找体素中缓存的平面，并且要求当前的近邻点都在平面threshold范围内，否则视为未命中
+	//只读，多个线程可以同时调用(期间不能insert)
+	bool lookup(int64_t k, const MapPointVector &points_near, float threshold, Eigen::Matrix<float, 4, 1> &pabcd) const
+	{
+		auto it = map_.find(k);
+		if (it == map_.end())
+			return false;
+		const entry &e = it->second;
+		for (int j = 0; j < NUM_MATCH_POINTS; j++)
+		{
+			if (std::fabs(e.a * points_near[j].x + e.b * points_near[j].y + e.c * points_near[j].z + e.d) > threshold)
+				return false;
+		}
+		pabcd << e.a, e.b, e.c, e.d;
+		return true;
+	}
+
+	//由拟合成功的平面生成缓存项
+	static entry make_entry(const Eigen::Matrix<float, 4, 1> &pabcd, const MapPointVector &points_near)
+	{
+		entry e{pabcd(0), pabcd(1), pabcd(2), pabcd(3), 0.f};
+		for (int j = 0; j < NUM_MATCH_POINTS; j++)
+			e.quality = std::max(e.quality, std::fabs(e.a * points_near[j].x + e.b * points_near[j].y + e.c * points_near[j].z + e.d));
+		return e;
+	}
+
+	//同一体素已有缓存时保留拟合质量更好的平面
+	void insert(int64_t k, const entry &e)
+	{
+		auto res = map_.emplace(k, e);
+		if (!res.second && e.quality < res.first->second.quality)
+			res.first->second = e;
+	}
+
+	//地图中新增了点，所在体素的缓存失效
+	void invalidate(const MapPointVector &points)
+	{
+		for (const MapPointType &p : points)
+			map_.erase(key(p));
+	}
+
+	//地图中删除了这些区域的点，区域内体素的缓存失效
+	void invalidate(const vector<BoxPointType> &boxes)
+	{
+		if (boxes.empty())
+			return;
+		for (auto it = map_.begin(); it != map_.end();)
+		{
+			float center[3];
+			for (int i = 0; i < 3; i++)
+				center[i] = (float(((it->first >> (21 * i)) & MASK) - OFFSET) + 0.5f) * voxel_size_;
+
+			bool removed = false;
+			for (const BoxPointType &box : boxes)
+			{
+				if (center[0] >= box.vertex_min[0] && center[0] <= box.vertex_max[0] &&
+					center[1] >= box.vertex_min[1] && center[1] <= box.vertex_max[1] &&
+					center[2] >= box.vertex_min[2] && center[2] <= box.vertex_max[2])
+				{
+					removed = true;
+					break;
+				}
+			}
+			it = removed ? map_.erase(it) : std::next(it);
+		}
+	}
+
+	size_t size() const
+	{
+		return map_.size();
+	}
+
+private:
+	static constexpr int64_t OFFSET = int64_t(1) << 20;
+	static constexpr int64_t MASK = (int64_t(1) << 21) - 1;
+
+	float voxel_size_ = 0.5f;
+	std::unordered_map<int64_t, entry> map_;
+};
+
+#endif
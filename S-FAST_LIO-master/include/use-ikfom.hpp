@@ -48,47 +48,86 @@ Eigen::Matrix<double, 12, 12> process_noise_cov()
 	return Q;
 }
 
+//误差状态向量的布局(编译期确定): 各分量在误差状态向量中的起始下标, -1表示该分量不参与估计(视为常量)
+//EXTRINSIC_: 是否估计lidar-IMU外参  GRAVITY_: 是否估计重力
+template <bool EXTRINSIC_, bool GRAVITY_>
+struct state_layout
+{
+	enum
+	{
+		EXTRINSIC = EXTRINSIC_,
+		GRAVITY = GRAVITY_,
+		POS = 0,
+		ROT = 3,
+		OFF_R = EXTRINSIC_ ? 6 : -1,
+		OFF_T = EXTRINSIC_ ? 9 : -1,
+		VEL = EXTRINSIC_ ? 12 : 6,
+		BG = VEL + 3,
+		BA = VEL + 6,
+		GRAV = GRAVITY_ ? VEL + 9 : -1,
+		DIM = VEL + (GRAVITY_ ? 12 : 9), //误差状态维数
+		H_DIM = EXTRINSIC_ ? 12 : 6		 //观测雅可比H中非零列数(pos, rot, 以及外参)
+	};
+};
+
+typedef state_layout<true, true> state_layout_24;	//24维: 估计外参和重力
+typedef state_layout<false, true> state_layout_18;	//18维: 外参固定(标定后 extrinsic_est_en: false)
+typedef state_layout<false, false> state_layout_15; //15维: 外参和重力都固定
+
+//编译时通过 -DSTATE_DIM=24/18/15 选择使用的状态布局(见CMakeLists.txt)
+#ifndef STATE_DIM
+#define STATE_DIM 24
+#endif
+#if STATE_DIM == 15
+typedef state_layout_15 state_layout_t;
+#elif STATE_DIM == 18
+typedef state_layout_18 state_layout_t;
+#else
+typedef state_layout_24 state_layout_t;
+#endif
+
 //对应公式(2) 中的f
-Eigen::Matrix<double, 24, 1> get_f(state_ikfom s, input_ikfom in)	
+template <typename L = state_layout_t>
+Eigen::Matrix<double, L::DIM, 1> get_f(const state_ikfom &s, const input_ikfom &in)
 {
-// 对应顺序为速度(3)，角速度(3),外参T(3),外参旋转R(3)，加速度(3),角速度偏置(3),加速度偏置(3),位置(3)，与论文公式顺序不一致
-	Eigen::Matrix<double, 24, 1> res = Eigen::Matrix<double, 24, 1>::Zero();
+// 对应顺序为位置(3)，角速度(3),[外参R(3),外参T(3)]，速度(3),角速度偏置(3),加速度偏置(3),[重力(3)]，与论文公式顺序不一致
+	Eigen::Matrix<double, L::DIM, 1> res = Eigen::Matrix<double, L::DIM, 1>::Zero();
 	Eigen::Vector3d omega = in.gyro - s.bg;		// 输入的imu的角速度(也就是实际测量值) - 估计的bias值(对应公式的第1行)
 	Eigen::Vector3d a_inertial = s.rot.matrix() * (in.acc - s.ba);		//  输入的imu的加速度，先转到世界坐标系（对应公式的第3行）
 
-	for (int i = 0; i < 3; i++)
-	{
-		res(i) = s.vel[i];		//速度（对应公式第2行）
-		res(i + 3) = omega[i];	//角速度（对应公式第1行）
-		res(i + 12) = a_inertial[i] + s.grav[i];		//加速度（对应公式第3行）
-	}
+	res.template segment<3>(L::POS) = s.vel;				//速度（对应公式第2行）
+	res.template segment<3>(L::ROT) = omega;				//角速度（对应公式第1行）
+	res.template segment<3>(L::VEL) = a_inertial + s.grav;	//加速度（对应公式第3行）
 
 	return res;
 }
 
 //对应公式(7)的Fx  注意该矩阵没乘dt，没加单位阵
-Eigen::Matrix<double, 24, 24> df_dx(state_ikfom s, input_ikfom in)
+template <typename L = state_layout_t>
+Eigen::Matrix<double, L::DIM, L::DIM> df_dx(const state_ikfom &s, const input_ikfom &in)
 {
-	Eigen::Matrix<double, 24, 24> cov = Eigen::Matrix<double, 24, 24>::Zero();
-	cov.block<3, 3>(0, 12) = Eigen::Matrix3d::Identity();	//对应公式(7)第2行第3列   I
+	Eigen::Matrix<double, L::DIM, L::DIM> cov = Eigen::Matrix<double, L::DIM, L::DIM>::Zero();
+	cov.template block<3, 3>(L::POS, L::VEL) = Eigen::Matrix3d::Identity();	//对应公式(7)第2行第3列   I
 	Eigen::Vector3d acc_ = in.acc - s.ba;   	//测量加速度 = a_m - bias	
 
-	cov.block<3, 3>(12, 3) = -s.rot.matrix() * Sophus::SO3::hat(acc_);		//对应公式(7)第3行第1列
-	cov.block<3, 3>(12, 18) = -s.rot.matrix(); 				//对应公式(7)第3行第5列 
+	cov.template block<3, 3>(L::VEL, L::ROT) = -s.rot.matrix() * Sophus::SO3::hat(acc_);		//对应公式(7)第3行第1列
+	cov.template block<3, 3>(L::VEL, L::BA) = -s.rot.matrix(); 				//对应公式(7)第3行第5列 
 
-	cov.template block<3, 3>(12, 21) = Eigen::Matrix3d::Identity();		//对应公式(7)第3行第6列   I
-	cov.template block<3, 3>(3, 15) = -Eigen::Matrix3d::Identity();		//对应公式(7)第1行第4列 (简化为-I)
+	if (L::GRAVITY)
+		cov.template block<3, 3>(L::VEL, L::GRAV) = Eigen::Matrix3d::Identity();		//对应公式(7)第3行第6列   I
+	cov.template block<3, 3>(L::ROT, L::BG) = -Eigen::Matrix3d::Identity();		//对应公式(7)第1行第4列 (简化为-I)
 	return cov;
 }
 
 //对应公式(7)的Fw  注意该矩阵没乘dt
-Eigen::Matrix<double, 24, 12> df_dw(state_ikfom s, input_ikfom in)
+template <typename L = state_layout_t>
+Eigen::Matrix<double, L::DIM, 12> df_dw(const state_ikfom &s, const input_ikfom &in)
 {
-	Eigen::Matrix<double, 24, 12> cov = Eigen::Matrix<double, 24, 12>::Zero();
-	cov.block<3, 3>(12, 3) = -s.rot.matrix();					//对应公式(7)第3行第2列  -R 
-	cov.block<3, 3>(3, 0) = -Eigen::Matrix3d::Identity();		//对应公式(7)第1行第1列  -A(w dt)简化为-I
-	cov.block<3, 3>(15, 6) = Eigen::Matrix3d::Identity();		//对应公式(7)第4行第3列  I
-	cov.block<3, 3>(18, 9) = Eigen::Matrix3d::Identity();		//对应公式(7)第5行第4列  I
+	Eigen::Matrix<double, L::DIM, 12> cov = Eigen::Matrix<double, L::DIM, 12>::Zero();
+	cov.template block<3, 3>(L::VEL, 3) = -s.rot.matrix();					//对应公式(7)第3行第2列  -R 
+	cov.template block<3, 3>(L::ROT, 0) = -Eigen::Matrix3d::Identity();		//对应公式(7)第1行第1列  -A(w dt)简化为-I
+	cov.template block<3, 3>(L::BG, 6) = Eigen::Matrix3d::Identity();		//对应公式(7)第4行第3列  I
+	cov.template block<3, 3>(L::BA, 9) = Eigen::Matrix3d::Identity();		//对应公式(7)第5行第4列  I
 	return cov;
 }
 
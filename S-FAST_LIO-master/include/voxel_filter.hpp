@@ -0,0 +1,181 @@
+#ifndef VOXEL_FILTER_HPP
+#define VOXEL_FILTER_HPP
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#include "common_lib.h"
+
+//哈希体素降采样，代替pcl::VoxelGrid(不再对整帧点的体素索引排序)
+//每个体素保留离体素中心最近的一个原始点(距离相同时保留序号小的)，输出按输入顺序排列，结果与线程数无关
+//点云按顺序分成MP_PROC_NUM段并行建表，段之间重复的体素在合并时处理，哈希表在帧之间复用
+class voxel_filter
+{
+public:
+	void set_leaf_size(float leaf)
+	{
+		leaf_ = leaf;
+		inv_leaf_ = 1.0f / leaf;
+	}
+
+	void filter(const PointCloudXYZI &in, PointCloudXYZI &out)
+	{
+		int n = in.size();
+		out.clear();
+		if (n == 0)
+			return;
+		int chunk_num = 1;
+#ifdef MP_EN
+		chunk_num = max(min(MP_PROC_NUM, n / Min_Chunk_Size), 1);
+#endif
+		if (int(chunks_.size()) < chunk_num)
+			chunks_.resize(chunk_num);
+		keep_.assign(n, 0);
+
+#ifdef MP_EN
+#pragma omp parallel for num_threads(chunk_num) schedule(static, 1)
+#endif
+		for (int c = 0; c < chunk_num; c++)
+		{
+			int begin = int(int64_t(n) * c / chunk_num), end = int(int64_t(n) * (c + 1) / chunk_num);
+			table &t = chunks_[c];
+			t.reset(min(size_t(end - begin), t.size + t.size / 4));
+			slot *last = nullptr; //按扫描顺序相邻的点大多落在同一个体素，先和上一个点的体素比较
+			for (int i = begin; i < end; i++)
+			{
+				const PointType &p = in.points[i];
+				if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+					continue;
+				float dist;
+				uint64_t k = key(p, dist);
+				if (last != nullptr && last->key == k)
+					table::update(*last, i, dist);
+				else
+					last = t.insert(k, i, dist);
+			}
+		}
+
+		//合并各段的结果，只有跨段的体素需要比较
+		table *result = &chunks_[0];
+		if (chunk_num > 1)
+		{
+			size_t voxel_num = 0;
+			for (int c = 0; c < chunk_num; c++)
+				voxel_num += chunks_[c].size;
+			merged_.reset(voxel_num);
+			for (int c = 0; c < chunk_num; c++)
+				for (const slot &s : chunks_[c].slots)
+					if (s.key != EMPTY)
+						merged_.insert(s.key, s.idx, s.dist);
+			result = &merged_;
+		}
+		for (const slot &s : result->slots)
+			if (s.key != EMPTY)
+				keep_[s.idx] = 1;
+
+		out.points.reserve(result->size);
+		for (int i = 0; i < n; i++)
+			if (keep_[i])
+				out.points.push_back(in.points[i]);
+		out.width = out.points.size();
+		out.height = 1;
+		out.is_dense = true;
+	}
+
+private:
+	static constexpr uint64_t EMPTY = ~uint64_t(0);
+	static constexpr int64_t OFFSET = int64_t(1) << 20;
+	static constexpr int64_t MASK = (int64_t(1) << 21) - 1;
+	static constexpr int Min_Chunk_Size = 4096; //点数太少时不值得开线程
+
+	struct slot
+	{
+		uint64_t key;
+		int idx;	//保留的点在输入中的序号
+		float dist; //到体素中心的距离平方
+	};
+
+	//开放寻址的哈希表，容量是2的幂，元素超过容量的一半时扩容
+	//按上一帧的体素数预估容量，避免每帧按点数开一张过大的表
+	struct table
+	{
+		vector<slot> slots;
+		uint64_t mask = 0;
+		size_t size = 0;
+
+		void reset(size_t expected)
+		{
+			size_t cap = 16;
+			while (cap < 2 * expected)
+				cap <<= 1;
+			slots.assign(cap, slot{EMPTY, -1, 0.f});
+			mask = cap - 1;
+			size = 0;
+		}
+
+		void grow()
+		{
+			vector<slot> old;
+			old.swap(slots);
+			slots.assign(old.size() * 2, slot{EMPTY, -1, 0.f});
+			mask = slots.size() - 1;
+			size = 0;
+			for (const slot &s : old)
+				if (s.key != EMPTY)
+					insert(s.key, s.idx, s.dist);
+		}
+
+		static void update(slot &s, int idx, float dist)
+		{
+			if (dist < s.dist || (dist == s.dist && idx < s.idx))
+			{
+				s.idx = idx;
+				s.dist = dist;
+			}
+		}
+
+		//返回体素所在的槽，扩容后之前返回的指针失效
+		slot *insert(uint64_t key, int idx, float dist)
+		{
+			if (2 * (size + 1) > slots.size())
+				grow();
+			uint64_t h = (key * 0x9E3779B97F4A7C15ULL) >> 20;
+			while (true)
+			{
+				slot &s = slots[h & mask];
+				if (s.key == EMPTY)
+				{
+					s = slot{key, idx, dist};
+					size++;
+					return &s;
+				}
+				if (s.key == key)
+				{
+					update(s, idx, dist);
+					return &s;
+				}
+				h++;
+			}
+		}
+	};
+
+	//体素的key(每个方向21位)，dist返回点到体素中心的距离平方
+	uint64_t key(const PointType &p, float &dist) const
+	{
+		float fx = std::floor(p.x * inv_leaf_), fy = std::floor(p.y * inv_leaf_), fz = std::floor(p.z * inv_leaf_);
+		float dx = p.x - (fx + 0.5f) * leaf_, dy = p.y - (fy + 0.5f) * leaf_, dz = p.z - (fz + 0.5f) * leaf_;
+		dist = dx * dx + dy * dy + dz * dz;
+		return uint64_t((int64_t(fx) + OFFSET) & MASK) | (uint64_t((int64_t(fy) + OFFSET) & MASK) << 21) |
+			   (uint64_t((int64_t(fz) + OFFSET) & MASK) << 42);
+	}
+
+	float leaf_ = 0.5f, inv_leaf_ = 2.0f;
+	vector<table> chunks_;
+	table merged_;
+	vector<uint8_t> keep_;
+};
+
+#endif
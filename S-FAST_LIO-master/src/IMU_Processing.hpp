@@ -1,4 +1,5 @@
 #include <cmath>
+#include <cstring>
 #include <math.h>
 #include <deque>
 #include <mutex>
@@ -24,6 +25,7 @@
 
 #include "use-ikfom.hpp"
 #include "esekfom.hpp"
+#include "voxel_filter.hpp"
 
 /*
 这个hpp主要包含：
@@ -34,6 +36,14 @@ IMU数据预处理：IMU初始化，IMU正向传播，反向传播补偿运动
 //判断点的时间先后顺序(注意curvature中存储的是时间戳)
 const bool time_list(PointType &x, PointType &y) {return (x.curvature < y.curvature);};
 
+//curvature的位模式转成无符号整数，大小顺序与浮点数一致(负数也适用)
+inline uint32_t time_key(float t)
+{
+  uint32_t u;
+  memcpy(&u, &t, sizeof(u));
+  return (u & 0x80000000u) ? ~u : (u | 0x80000000u);
+}
+
 class ImuProcess
 {
  public:
@@ -44,6 +54,8 @@ class ImuProcess
   
   void Reset();
   void set_param(const V3D &transl, const M3D &rot, const V3D &gyr, const V3D &acc, const V3D &gyr_bias, const V3D &acc_bias);
+  void set_undistort_tolerance(double tol) {undistort_tol = tol;}
+  void set_downsample_filter(voxel_filter *filter) {down_filter_ = filter;}  //非空时去畸变前先降采样，只补偿留下的点
   Eigen::Matrix<double, 12, 12> Q;    //噪声协方差矩阵  对应论文式(8)中的Q
   void Process(const MeasureGroup &meas, esekfom::esekf &kf_state, PointCloudXYZI::Ptr &pcl_un_);
 
@@ -54,10 +66,15 @@ class ImuProcess
   V3D cov_bias_gyr;        //角速度bias的协方差
   V3D cov_bias_acc;        //加速度bias的协方差
   double first_lidar_time; //当前帧第一个点云时间
+  double downsample_time = 0;  //去畸变前降采样的耗时(s)
 
  private:
+  friend class ImuProcessTest;  //test/test_undistort.cpp 直接驱动UndistortPcl并与逐点原公式比较
+
   void IMU_init(const MeasureGroup &meas, esekfom::esekf &kf_state, int &N);
   void UndistortPcl(const MeasureGroup &meas, esekfom::esekf &kf_state, PointCloudXYZI &pcl_in_out);
+  void SortByTime(PointCloudXYZI &pcl);
+  static void CompensateSoA(const float c[3][12], float *x, float *y, float *z, const float *t, int n);
 
   PointCloudXYZI::Ptr cur_pcl_un_;        //当前帧点云未去畸变
   sensor_msgs::ImuConstPtr last_imu_;     // 上一帧imu
@@ -73,6 +90,13 @@ class ImuProcess
   int init_iter_num = 1;                  //初始化迭代次数
   bool b_first_frame_ = true;             //是否是第一帧
   bool imu_need_init_ = true;             //是否需要初始化imu
+  vector<uint64_t> time_keys_, time_keys_tmp_;  //按时间排序用的(时间,序号)键，帧之间复用
+  PointVector time_sorted_;                     //排序后的点，和点云交换后复用
+  vector<int> seg_begin_;                       //每个IMU区间负责的第一个点
+  vector<float> soa_x_, soa_y_, soa_z_, soa_t_; //去畸变时点的SoA坐标和到区间开始的时间
+  double undistort_tol = 0.001;                 //去畸变近似计算允许的最大误差(m)，<=0时全部按原公式计算
+  voxel_filter *down_filter_ = nullptr;         //去畸变前的降采样(不需要整帧去畸变的点云时)
+  PointCloudXYZI down_tmp_;                     //降采样的输出，和点云交换后复用
 };
 
 ImuProcess::ImuProcess()
@@ -163,18 +187,64 @@ void ImuProcess::IMU_init(const MeasureGroup &meas, esekfom::esekf &kf_state, in
   init_state.offset_R_L_I = Sophus::SO3(Lidar_R_wrt_IMU);
   kf_state.change_x(init_state);      //将初始化后的状态传入esekfom.hpp中的x_
 
-  Matrix<double, 24, 24> init_P = MatrixXd::Identity(24,24);      //在esekfom.hpp获得P_的协方差矩阵
-  init_P(6,6) = init_P(7,7) = init_P(8,8) = 0.00001;
-  init_P(9,9) = init_P(10,10) = init_P(11,11) = 0.00001;
-  init_P(15,15) = init_P(16,16) = init_P(17,17) = 0.0001;
-  init_P(18,18) = init_P(19,19) = init_P(20,20) = 0.001;
-  init_P(21,21) = init_P(22,22) = init_P(23,23) = 0.00001; 
+  typedef state_layout_t L;
+  esekfom::esekf::cov init_P = esekfom::esekf::cov::Identity();      //在esekfom.hpp获得P_的协方差矩阵
+  if (L::EXTRINSIC)
+  {
+    init_P.block<3, 3>(L::OFF_R, L::OFF_R).diagonal().setConstant(0.00001);
+    init_P.block<3, 3>(L::OFF_T, L::OFF_T).diagonal().setConstant(0.00001);
+  }
+  init_P.block<3, 3>(L::BG, L::BG).diagonal().setConstant(0.0001);
+  init_P.block<3, 3>(L::BA, L::BA).diagonal().setConstant(0.001);
+  if (L::GRAVITY)
+    init_P.block<3, 3>(L::GRAV, L::GRAV).diagonal().setConstant(0.00001);
   kf_state.change_P(init_P);
   last_imu_ = meas.imu.back();
 
   std::cout << "IMU init new -- init_state  " << init_state.pos  <<" " << init_state.bg <<" " << init_state.ba <<" " << init_state.grav << std::endl;
 }
 
+//按curvature(时间)对点云做基数排序，代替std::sort的比较排序，线性时间
+//键的高32位是时间，低32位是点的序号，同一时间的点保持原来的顺序
+void ImuProcess::SortByTime(PointCloudXYZI &pcl)
+{
+  const size_t n = pcl.points.size();
+  if (n < 2) return;
+  time_keys_.resize(n);
+  time_keys_tmp_.resize(n);
+  bool sorted = true;
+  for (size_t i = 0; i < n; i++)
+  {
+    time_keys_[i] = (uint64_t(time_key(pcl.points[i].curvature)) << 32) | i;
+    if (i > 0 && time_keys_[i] < time_keys_[i - 1]) sorted = false;
+  }
+  if (sorted) return;
+
+  //低位优先，三趟分别处理时间键的11、11、10位，所有点在这一位段上都相同时跳过
+  const int shifts[3] = {32, 43, 54};
+  const int bits[3] = {11, 11, 10};
+  for (int pass = 0; pass < 3; pass++)
+  {
+    size_t count[2048] = {0};
+    const uint64_t mask = (uint64_t(1) << bits[pass]) - 1;
+    for (size_t i = 0; i < n; i++) count[(time_keys_[i] >> shifts[pass]) & mask]++;
+    if (count[(time_keys_[0] >> shifts[pass]) & mask] == n) continue;
+    size_t sum = 0;
+    for (int b = 0; b <= int(mask); b++)
+    {
+      size_t c = count[b];
+      count[b] = sum;
+      sum += c;
+    }
+    for (size_t i = 0; i < n; i++) time_keys_tmp_[count[(time_keys_[i] >> shifts[pass]) & mask]++] = time_keys_[i];
+    time_keys_.swap(time_keys_tmp_);
+  }
+
+  time_sorted_.resize(n);
+  for (size_t i = 0; i < n; i++) time_sorted_[i] = pcl.points[uint32_t(time_keys_[i])];
+  pcl.points.swap(time_sorted_);
+}
+
 //反向传播
 void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf &kf_state, PointCloudXYZI &pcl_out)
 {
@@ -185,9 +255,19 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf &kf_state
   const double &pcl_beg_time = meas.lidar_beg_time;      // 点云开始和结束的时间戳
   const double &pcl_end_time = meas.lidar_end_time;
   
-  // 根据点云中每个点的时间戳对点云进行重排序
-  pcl_out = *(meas.lidar);
-  sort(pcl_out.points.begin(), pcl_out.points.end(), time_list);  //这里curvature中存放了时间戳（在preprocess.cpp中）
+  // 根据点云中每个点的时间戳对点云进行重排序，预处理已经按时间排好的点云(meas.lidar_time_ordered)不再排序
+  if (&pcl_out != meas.lidar.get()) pcl_out = *(meas.lidar);   //Process中pcl_out就是meas.lidar，原地去畸变不拷贝
+  if (!meas.lidar_time_ordered) SortByTime(pcl_out);  //这里curvature中存放了时间戳（在preprocess.cpp中）
+
+  //降采样和去畸变融合：体素按去畸变前的坐标划分，被滤掉的点不再补偿，整帧去畸变的点云不会生成
+  //降采样保持点的先后顺序，输出仍按时间排好
+  if (down_filter_ != nullptr)
+  {
+    double t_down = omp_get_wtime();
+    down_filter_->filter(pcl_out, down_tmp_);
+    pcl_out.swap(down_tmp_);
+    downsample_time = omp_get_wtime() - t_down;
+  }
 
 
   state_ikfom imu_state = kf_state.get_x();  // 获取上一次KF估计的后验状态作为本次IMU预测的初始状态
@@ -196,8 +276,7 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf &kf_state
   //将初始状态加入IMUpose中,包含有时间间隔，上一帧加速度，上一帧角速度，上一帧速度，上一帧位置，上一帧旋转矩阵
 
   /*** 前向传播 ***/
-  V3D angvel_avr, acc_avr, acc_imu, vel_imu, pos_imu; // angvel_avr为平均角速度，acc_avr为平均加速度，acc_imu为imu加速度，vel_imu为imu速度，pos_imu为imu位置
-  M3D R_imu;    //IMU旋转矩阵 消除运动失真的时候用
+  V3D angvel_avr, acc_avr; // angvel_avr为平均角速度，acc_avr为平均加速度
 
   double dt = 0;
 
@@ -236,7 +315,7 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf &kf_state
     Q.block<3, 3>(6, 6).diagonal() = cov_bias_gyr;
     Q.block<3, 3>(9, 9).diagonal() = cov_bias_acc;
 
-    kf_state.predict(dt, Q, in);    // IMU前向传播，每次传播的时间间隔为dt
+    kf_state.predict_batch(dt, Q, in);    // IMU前向传播，每次传播的时间间隔为dt（协方差在本帧最后一次性传播）
 
     imu_state = kf_state.get_x();   //更新IMU状态为积分后的状态
     //更新上一帧角速度 = 后一帧角速度-bias  
@@ -256,47 +335,147 @@ void ImuProcess::UndistortPcl(const MeasureGroup &meas, esekfom::esekf &kf_state
 
   // 把最后一帧IMU测量也补上
   dt = abs(pcl_end_time - imu_end_time);
-  kf_state.predict(dt, Q, in);
+  kf_state.predict_batch(dt, Q, in);
+  kf_state.flush_predict();   // 把整帧的状态转移和噪声一次性作用到协方差上
   imu_state = kf_state.get_x();   
   last_imu_ = meas.imu.back();              //保存最后一个IMU测量，以便于下一帧使用
   last_lidar_end_time_ = pcl_end_time;      //保存这一帧最后一个雷达测量的结束时间，以便于下一帧使用
 
    /***消除每个激光雷达点的失真（反向传播）***/
   if (pcl_out.points.begin() == pcl_out.points.end()) return;
-  auto it_pcl = pcl_out.points.end() - 1;
 
-  //遍历每个IMU帧
-  for (auto it_kp = IMUpose.end() - 1; it_kp != IMUpose.begin(); it_kp--)
+  //点云已按时间排序，IMUpose也按时间排序：区间k(head为IMUpose[k-1]，tail为IMUpose[k])负责时间大于head时刻的点
+  //从后往前划分，每个点只属于一个区间，之后各区间互不相关，可以并行补偿
+  const int seg_num = IMUpose.size() - 1;
+  seg_begin_.assign(IMUpose.size() + 1, 0);
+  int idx = pcl_out.points.size();
+  seg_begin_[seg_num + 1] = idx;
+  for (int k = seg_num; k >= 1; k--)
+  {
+    while (idx > 0 && pcl_out.points[idx - 1].curvature / double(1000) > IMUpose[k - 1].offset_time) idx--;
+    seg_begin_[k] = idx;
+  }
+
+  const size_t n = pcl_out.points.size();
+  soa_x_.resize(n);
+  soa_y_.resize(n);
+  soa_z_.resize(n);
+  soa_t_.resize(n);
+
+  const M3D R_LI = imu_state.offset_R_L_I.matrix();
+  const V3D &T_LI = imu_state.offset_T_L_I;
+  const M3D R_LE = R_LI.transpose() * imu_state.rot.matrix().transpose();   //末尾时刻IMU系到雷达系的旋转
+
+#ifdef MP_EN
+  #pragma omp parallel for num_threads(MP_PROC_NUM) schedule(dynamic)
+#endif
+  for (int k = 1; k <= seg_num; k++)
   {
-    auto head = it_kp - 1;
-    auto tail = it_kp;
+    const int begin = seg_begin_[k], end = seg_begin_[k + 1];
+    if (begin >= end) continue;
+    auto head = IMUpose.begin() + k - 1;
+    auto tail = IMUpose.begin() + k;
+    M3D R_imu;
+    V3D vel_imu, pos_imu, acc_imu, angvel_avr;
     R_imu<<MAT_FROM_ARRAY(head->rot);   //拿到前一帧的IMU旋转矩阵
-    // cout<<"head imu acc: "<<acc_imu.transpose()<<endl;
     vel_imu<<VEC_FROM_ARRAY(head->vel);     //拿到前一帧的IMU速度
     pos_imu<<VEC_FROM_ARRAY(head->pos);     //拿到前一帧的IMU位置
     acc_imu<<VEC_FROM_ARRAY(tail->acc);     //拿到后一帧的IMU加速度
     angvel_avr<<VEC_FROM_ARRAY(tail->gyr);  //拿到后一帧的IMU角速度
 
-    //之前点云按照时间从小到大排序过，IMUpose也同样是按照时间从小到大push进入的
-    //此时从IMUpose的末尾开始循环，也就是从时间最大处开始，因此只需要判断 点云时间需>IMU head时刻  即可   不需要判断 点云时间<IMU tail
-    for(; it_pcl->curvature / double(1000) > head->offset_time; it_pcl --)
+    //把点转成SoA的float数组，同时求点到雷达中心的最大距离
+    double r_max = 0;
+    for (int i = begin; i < end; i++)
     {
-      dt = it_pcl->curvature / double(1000) - head->offset_time;    //点到IMU开始时刻的时间间隔 
+      const PointType &p = pcl_out.points[i];
+      soa_x_[i] = p.x;
+      soa_y_[i] = p.y;
+      soa_z_[i] = p.z;
+      soa_t_[i] = float(p.curvature / double(1000) - head->offset_time);
+      r_max = max(r_max, double(p.x * p.x + p.y * p.y + p.z * p.z));
+    }
+    r_max = sqrt(r_max) + T_LI.norm();
+
+    //exp(w*dt)用二阶展开 I + dt*W + dt^2/2*W^2 代替，旋转误差不超过 theta^3/6，theta为区间内最大转角
+    //误差超过undistort_tol的区间(转得快或者区间长)仍然按原公式逐点计算
+    const double theta = angvel_avr.norm() * (pcl_out.points[end - 1].curvature / double(1000) - head->offset_time);
+    if (undistort_tol > 0 && theta * theta * theta / 6.0 * r_max < undistort_tol)
+    {
+      /*    P_compensate = (B0 + dt*B1 + dt^2*B2) * P + (d0 + dt*d1 + dt^2*d2)    */
+      M3D W;
+      W << 0, -angvel_avr(2), angvel_avr(1),
+           angvel_avr(2), 0, -angvel_avr(0),
+           -angvel_avr(1), angvel_avr(0), 0;
+      const M3D A(R_LE * R_imu), AW(A * W), AWW(0.5 * AW * W);
+      const M3D B0(A * R_LI), B1(AW * R_LI), B2(AWW * R_LI);
+      const V3D d0(A * T_LI + R_LE * (pos_imu - imu_state.pos) - R_LI.transpose() * T_LI);
+      const V3D d1(AW * T_LI + R_LE * vel_imu);
+      const V3D d2(AWW * T_LI + 0.5 * R_LE * acc_imu);
+      float c[3][12];    //每一行: B0行, B1行, B2行, d0/d1/d2
+      for (int r = 0; r < 3; r++)
+      {
+        for (int j = 0; j < 3; j++)
+        {
+          c[r][j] = B0(r, j);
+          c[r][3 + j] = B1(r, j);
+          c[r][6 + j] = B2(r, j);
+        }
+        c[r][9] = d0(r);
+        c[r][10] = d1(r);
+        c[r][11] = d2(r);
+      }
+      CompensateSoA(c, &soa_x_[begin], &soa_y_[begin], &soa_z_[begin], &soa_t_[begin], end - begin);
+      for (int i = begin; i < end; i++)
+      {
+        pcl_out.points[i].x = soa_x_[i];
+        pcl_out.points[i].y = soa_y_[i];
+        pcl_out.points[i].z = soa_z_[i];
+      }
+      continue;
+    }
+
+    for (int i = begin; i < end; i++)
+    {
+      PointType &p = pcl_out.points[i];
+      double dt = p.curvature / double(1000) - head->offset_time;    //点到IMU开始时刻的时间间隔
 
       /*    P_compensate = R_imu_e ^ T * (R_i * P_i + T_ei)    */
 
-      M3D R_i(R_imu * Sophus::SO3::exp(angvel_avr * dt).matrix() );   //点it_pcl所在时刻的旋转：前一帧的IMU旋转矩阵 * exp(后一帧角速度*dt)   
-      
-      V3D P_i(it_pcl->x, it_pcl->y, it_pcl->z);   //点所在时刻的位置(雷达坐标系下)
+      M3D R_i(R_imu * Sophus::SO3::exp(angvel_avr * dt).matrix() );   //点所在时刻的旋转：前一帧的IMU旋转矩阵 * exp(后一帧角速度*dt)
+
+      V3D P_i(p.x, p.y, p.z);   //点所在时刻的位置(雷达坐标系下)
       V3D T_ei(pos_imu + vel_imu * dt + 0.5 * acc_imu * dt * dt - imu_state.pos);   //从点所在的世界位置-雷达末尾世界位置
-      V3D P_compensate = imu_state.offset_R_L_I.matrix().transpose() * (imu_state.rot.matrix().transpose() * (R_i * (imu_state.offset_R_L_I.matrix() * P_i + imu_state.offset_T_L_I) + T_ei) - imu_state.offset_T_L_I);
+      V3D P_compensate = R_LI.transpose() * (imu_state.rot.matrix().transpose() * (R_i * (R_LI * P_i + T_LI) + T_ei) - T_LI);
 
-      it_pcl->x = P_compensate(0);
-      it_pcl->y = P_compensate(1);
-      it_pcl->z = P_compensate(2);
+      p.x = P_compensate(0);
+      p.y = P_compensate(1);
+      p.z = P_compensate(2);
+    }
+  }
+}
 
-      if (it_pcl == pcl_out.points.begin()) break;
+//对一段SoA点做补偿，c的每一行对应输出的一个坐标：[B0行 B1行 B2行 d0 d1 d2]
+//各点之间没有依赖，编译器可以展开成float向量指令
+void ImuProcess::CompensateSoA(const float c[3][12], float *x, float *y, float *z, const float *t, int n)
+{
+#ifdef MP_EN
+  #pragma omp simd
+#endif
+  for (int i = 0; i < n; i++)
+  {
+    const float dt = t[i], px = x[i], py = y[i], pz = z[i];
+    float out[3];
+    for (int r = 0; r < 3; r++)
+    {
+      const float *cr = c[r];
+      out[r] = (cr[0] + dt * (cr[3] + dt * cr[6])) * px
+             + (cr[1] + dt * (cr[4] + dt * cr[7])) * py
+             + (cr[2] + dt * (cr[5] + dt * cr[8])) * pz
+             + cr[9] + dt * (cr[10] + dt * cr[11]);
     }
+    x[i] = out[0];
+    y[i] = out[1];
+    z[i] = out[2];
   }
 }
 
@@ -333,6 +512,7 @@ void ImuProcess::Process(const MeasureGroup &meas, esekfom::esekf &kf_state, Poi
     return;
   }
 
+  cur_pcl_un_ = meas.lidar;   //直接在预处理输出的点云上去畸变，不再整帧拷贝
   UndistortPcl(meas, kf_state, *cur_pcl_un_); 
 
   // T2 = omp_get_wtime();
@@ -24,6 +24,8 @@
 #include <ikd-Tree/ikd_Tree.h>
 
 #include "IMU_Processing.hpp"
+#include "voxel_filter.hpp"
+#include "cloud_pool.hpp"
 
 #define INIT_TIME (0.1)
 #define LASER_POINT_COV (0.001)
@@ -32,9 +34,25 @@
 /*** Time Log Variables ***/
 int add_point_size = 0, kdtree_delete_counter = 0;
 bool pcd_save_en = false, time_sync_en = false, extrinsic_est_en = true, path_en = true;
+bool info_form_update_en = true;
+double search_reuse_ratio = 0.1, iter_stop_epsi = 1e-4;
+bool plane_cache_en = false;
+int ikd_rebuild_threads = 2, ikd_rebuild_point_num = 1500, ikd_build_parallel_depth = 4;
+double ikd_delete_param = 0.5, ikd_balance_param = 0.6;
+bool ikd_stats_en = false;
+bool scan_stats_en = false;
+bool pool_stats_en = false;
+int ikd_depth_stats_interval = 100;
+string map_backend = "ikdtree";
+double ivox_resolution = 0.5;
+int ivox_nearby_type = 19, ivox_capacity = 1000000;
+double ivox_tile_size = 50.0;
+double undistort_tolerance = 0.001;
+bool fuse_downsample_en = false;
+double map_update_time = 0, map_incremental_time = 0, map_move_time = 0, downsample_time = 0;
+plane_cache map_plane_cache; //按地图体素缓存拟合的平面
 /**************************/
 
-float res_last[100000] = {0.0};
 float DET_RANGE = 300.0f;
 const float MOV_THRESHOLD = 1.5f;
 double time_diff_lidar_to_imu = 0.0;
@@ -56,11 +74,14 @@ bool lidar_pushed, flg_first_scan = true, flg_exit = false, flg_EKF_inited;
 bool scan_pub_en = false, dense_pub_en = false, scan_body_pub_en = false;
 
 vector<BoxPointType> cub_needrm;
-vector<PointVector> Nearest_Points;
+vector<BoxPointType> cub_evicted; //实际删除的区域(ivox按区块删除，可能大于cub_needrm)
+vector<MapPointVector> Nearest_Points;
 vector<double> extrinT(3, 0.0);
 vector<double> extrinR(9, 0.0);
 deque<double> time_buffer;
 deque<PointCloudXYZI::Ptr> lidar_buffer;
+deque<bool> ordered_buffer;    //lidar_buffer中每帧点云是否已经按时间排好序
+cloud_pool scan_pool;          //单帧点云的缓冲池，预处理->去畸变之间只传递指针
 deque<sensor_msgs::Imu::ConstPtr> imu_buffer;
 
 PointCloudXYZI::Ptr featsFromMap(new PointCloudXYZI());
@@ -68,10 +89,13 @@ PointCloudXYZI::Ptr feats_undistort(new PointCloudXYZI());
 PointCloudXYZI::Ptr feats_down_body(new PointCloudXYZI());  //畸变纠正后降采样的单帧点云，lidar系
 PointCloudXYZI::Ptr feats_down_world(new PointCloudXYZI()); //畸变纠正后降采样的单帧点云，W系
 
-pcl::VoxelGrid<PointType> downSizeFilterSurf;
+voxel_filter downSizeFilterSurf; //当前帧点云降采样(哈希体素，每个体素保留离中心最近的点)
 pcl::VoxelGrid<PointType> downSizeFilterMap;
 
-KD_TREE<PointType> ikdtree;
+KD_TREE<MapPointType> ikdtree;
+ikd_tree_map ikd_map(ikdtree);
+voxel_map ivox_map;
+local_map *map_ptr = &ikd_map; //当前使用的地图后端，由mapping/map_backend选择
 
 V3D Lidar_T_wrt_IMU(Zero3d);
 M3D Lidar_R_wrt_IMU(Eye3d);
@@ -106,11 +130,13 @@ void standard_pcl_cbk(const sensor_msgs::PointCloud2::ConstPtr &msg)
     {
         ROS_ERROR("lidar loop back, clear buffer");
         lidar_buffer.clear();
+        ordered_buffer.clear();
     }
 
-    PointCloudXYZI::Ptr ptr(new PointCloudXYZI());
+    PointCloudXYZI::Ptr ptr = scan_pool.acquire();
     p_pre->process(msg, ptr);
     lidar_buffer.push_back(ptr);
+    ordered_buffer.push_back(p_pre->time_ordered);
     time_buffer.push_back(msg->header.stamp.toSec());
     last_timestamp_lidar = msg->header.stamp.toSec();
     mtx_buffer.unlock();
@@ -128,6 +154,7 @@ void livox_pcl_cbk(const livox_ros_driver::CustomMsg::ConstPtr &msg)
     {
         ROS_ERROR("lidar loop back, clear buffer");
         lidar_buffer.clear();
+        ordered_buffer.clear();
     }
     last_timestamp_lidar = msg->header.stamp.toSec();
 
@@ -143,9 +170,10 @@ void livox_pcl_cbk(const livox_ros_driver::CustomMsg::ConstPtr &msg)
         printf("Self sync IMU and LiDAR, time diff is %.10lf \n", timediff_lidar_wrt_imu);
     }
 
-    PointCloudXYZI::Ptr ptr(new PointCloudXYZI());
+    PointCloudXYZI::Ptr ptr = scan_pool.acquire();
     p_pre->process(msg, ptr);
     lidar_buffer.push_back(ptr);
+    ordered_buffer.push_back(p_pre->time_ordered);
     time_buffer.push_back(last_timestamp_lidar);
 
     mtx_buffer.unlock();
@@ -197,6 +225,7 @@ bool sync_packages(MeasureGroup &meas)
     if (!lidar_pushed)
     {
         meas.lidar = lidar_buffer.front();
+        meas.lidar_time_ordered = ordered_buffer.front();
         meas.lidar_beg_time = time_buffer.front();
         if (meas.lidar->points.size() <= 5) // time too little
         {
@@ -237,6 +266,7 @@ bool sync_packages(MeasureGroup &meas)
     }
 
     lidar_buffer.pop_front();
+    ordered_buffer.pop_front();
     time_buffer.pop_front();
     lidar_pushed = false;
     return true;
@@ -270,6 +300,7 @@ void lasermap_fov_segment()
 {
     cub_needrm.clear(); // 清空需要移除的区域
     kdtree_delete_counter = 0;
+    map_move_time = 0;
 
     V3D pos_LiD = pos_lid; // W系下位置
     //初始化局部地图范围，以pos_LiD为中心,长宽高均为cube_len
@@ -322,11 +353,55 @@ void lasermap_fov_segment()
     }
     LocalMap_Points = New_LocalMap_Points;
 
-    PointVector points_history;
+    MapPointVector points_history;
     ikdtree.acquire_removed_points(points_history);
 
     if (cub_needrm.size() > 0)
-        kdtree_delete_counter = ikdtree.Delete_Point_Boxes(cub_needrm); //删除指定范围内的点
+    {
+        double st_time = omp_get_wtime();
+        kdtree_delete_counter = map_ptr->evict_boxes(cub_needrm, cub_evicted); //删除移出局部地图的区域(ivox整块摘下区块，在后台释放)
+        map_move_time = omp_get_wtime() - st_time;
+        if (plane_cache_en)
+            map_plane_cache.invalidate(cub_evicted); //按实际摘下的范围失效，ivox的区块可能超出cub_needrm
+    }
+}
+
+//输出ikd-Tree的运行统计(与上一帧的差值)，每ikd_depth_stats_interval帧输出一次深度直方图
+KD_TREE<MapPointType>::Tree_Stats ikd_stats_last;
+int ikd_stats_frames = 0;
+void print_ikd_stats()
+{
+    KD_TREE<MapPointType>::Tree_Stats st = ikdtree.tree_stats();
+    const KD_TREE<MapPointType>::Tree_Stats &last = ikd_stats_last;
+    size_t searches = st.searches - last.searches;
+    std::cout << "ikd-Tree searches: " << searches << "  nodes/search: " << (searches > 0 ? double(st.nodes_visited - last.nodes_visited) / searches : 0.0)
+              << "  rejected: " << st.search_rejected - last.search_rejected << "  reader retries: " << st.reader_retries - last.reader_retries << std::endl
+              << "ikd-Tree added: " << st.add_requests - last.add_requests << "  inserted: " << st.points_inserted - last.points_inserted
+              << "  downsample rejected: " << st.downsample_rejected - last.downsample_rejected << "  box deleted: " << st.box_deleted - last.box_deleted << std::endl
+              << "ikd-Tree rebuilds sync: " << st.sync_rebuilds - last.sync_rebuilds << " (" << (st.sync_rebuild_time - last.sync_rebuild_time) * 1000 << "ms)"
+              << "  background: " << st.background_rebuilds - last.background_rebuilds << " (" << (st.background_rebuild_time - last.background_rebuild_time) * 1000 << "ms)"
+              << "  lock waits: " << st.lock_waits - last.lock_waits << " (" << (st.lock_wait_time - last.lock_wait_time) * 1000 << "ms)"
+              << "  memory(MB): " << st.memory / 1048576.0 << std::endl;
+    ikd_stats_last = st;
+    if (ikd_depth_stats_interval > 0 && ++ikd_stats_frames % ikd_depth_stats_interval == 0)
+    {
+        vector<int> histogram;
+        ikdtree.depth_histogram(histogram);
+        std::cout << "ikd-Tree depth histogram:";
+        for (int n : histogram)
+            std::cout << " " << n;
+        std::cout << std::endl;
+    }
+}
+
+//输出单帧点云缓冲池自上次输出以来新分配的次数，稳定后应当都为0
+cloud_pool::stats pool_stats_last;
+void print_pool_stats()
+{
+    const cloud_pool::stats &st = scan_pool.get_stats();
+    std::cout << "scan buffers: " << scan_pool.size() << "  new clouds: " << st.clouds - pool_stats_last.clouds
+              << "  reallocated: " << st.grows - pool_stats_last.grows << std::endl;
+    pool_stats_last = st;
 }
 
 void RGBpointBodyLidarToIMU(PointType const *const pi, PointType *const po)
@@ -341,10 +416,23 @@ void RGBpointBodyLidarToIMU(PointType const *const pi, PointType *const po)
 }
 
 //根据最新估计位姿  增量添加点云到map
+//地图中的点(只有xyz和强度)转成PointCloudXYZI，用于发布和保存
+void get_map_cloud(PointCloudXYZI::Ptr &cloud)
+{
+    MapPointVector points;
+    map_ptr->get_points(points);
+    cloud->clear();
+    cloud->points.reserve(points.size());
+    for (const MapPointType &p : points)
+        cloud->points.push_back(from_map_point(p));
+    cloud->width = cloud->points.size();
+    cloud->height = 1;
+}
+
 void map_incremental()
 {
-    PointVector PointToAdd;
-    PointVector PointNoNeedDownsample;
+    MapPointVector PointToAdd;
+    MapPointVector PointNoNeedDownsample;
     PointToAdd.reserve(feats_down_size);
     PointNoNeedDownsample.reserve(feats_down_size);
     for (int i = 0; i < feats_down_size; i++)
@@ -354,7 +442,7 @@ void map_incremental()
 
         if (!Nearest_Points[i].empty() && flg_EKF_inited)
         {
-            const PointVector &points_near = Nearest_Points[i];
+            const MapPointVector &points_near = Nearest_Points[i];
             bool need_add = true;
             BoxPointType Box_of_Point;
             PointType mid_point; //点所在体素的中心
@@ -364,7 +452,7 @@ void map_incremental()
             float dist = calc_dist(feats_down_world->points[i], mid_point);
             if (fabs(points_near[0].x - mid_point.x) > 0.5 * filter_size_map_min && fabs(points_near[0].y - mid_point.y) > 0.5 * filter_size_map_min && fabs(points_near[0].z - mid_point.z) > 0.5 * filter_size_map_min)
             {
-                PointNoNeedDownsample.push_back(feats_down_world->points[i]); //如果距离最近的点都在体素外，则该点不需要Downsample
+                PointNoNeedDownsample.push_back(to_map_point(feats_down_world->points[i])); //如果距离最近的点都在体素外，则该点不需要Downsample
                 continue;
             }
             for (int j = 0; j < NUM_MATCH_POINTS; j++)
@@ -378,18 +466,24 @@ void map_incremental()
                 }
             }
             if (need_add)
-                PointToAdd.push_back(feats_down_world->points[i]);
+                PointToAdd.push_back(to_map_point(feats_down_world->points[i]));
         }
         else
         {
-            PointToAdd.push_back(feats_down_world->points[i]);
+            PointToAdd.push_back(to_map_point(feats_down_world->points[i]));
         }
     }
 
     double st_time = omp_get_wtime();
-    add_point_size = ikdtree.Add_Points(PointToAdd, true);
-    ikdtree.Add_Points(PointNoNeedDownsample, false);
+    add_point_size = map_ptr->add_points(PointToAdd, true);
+    map_ptr->add_points(PointNoNeedDownsample, false);
+    if (plane_cache_en) //新增点所在体素的平面缓存失效
+    {
+        map_plane_cache.invalidate(PointToAdd);
+        map_plane_cache.invalidate(PointNoNeedDownsample);
+    }
     add_point_size = PointToAdd.size() + PointNoNeedDownsample.size();
+    map_incremental_time = omp_get_wtime() - st_time;
 }
 
 PointCloudXYZI::Ptr pcl_wait_pub(new PointCloudXYZI(500000, 1));
@@ -576,12 +670,37 @@ int main(int argc, char **argv)
     nh.param<int>("point_filter_num", p_pre->point_filter_num, 2);           // 采样间隔，即每隔point_filter_num个点取1个点
     nh.param<bool>("feature_extract_enable", p_pre->feature_enabled, false); // 是否提取特征点（FAST_LIO2默认不进行特征点提取）
     nh.param<bool>("mapping/extrinsic_est_en", extrinsic_est_en, true);
+    nh.param<bool>("mapping/info_form_update", info_form_update_en, true); // ESKF更新时是否使用信息形式(不构造m X 12的雅可比矩阵)
+    nh.param<double>("mapping/search_reuse_ratio", search_reuse_ratio, 0.1); // 点的位移小于 search_reuse_ratio*filter_size_map 时复用上次的近邻
+    nh.param<double>("mapping/iter_stop_epsi", iter_stop_epsi, 1e-4);        // 状态增量小于该值时提前结束ESKF迭代
+    nh.param<bool>("mapping/plane_cache_en", plane_cache_en, false);         // 是否按地图体素缓存拟合的平面
+    nh.param<int>("mapping/ikd_rebuild_threads", ikd_rebuild_threads, 2);     // ikd-Tree后台重建子树的线程数
+    nh.param<int>("mapping/ikd_rebuild_point_num", ikd_rebuild_point_num, 1500); // 子树点数不少于该值时交给后台线程重建
+    nh.param<double>("mapping/ikd_delete_param", ikd_delete_param, 0.5);    // ikd-Tree删除点比例超过该值时重建
+    nh.param<double>("mapping/ikd_balance_param", ikd_balance_param, 0.6);  // ikd-Tree平衡判据
+    nh.param<int>("mapping/ikd_build_parallel_depth", ikd_build_parallel_depth, 4); // ikd-Tree整体构建时前几层子树并行构建
+    nh.param<bool>("mapping/scan_stats_en", scan_stats_en, false);               // 每帧输出近邻搜索、地图和各阶段耗时的统计
+    nh.param<bool>("mapping/ikd_stats_en", ikd_stats_en, false);                 // 每帧输出ikd-Tree的运行统计
+    nh.param<bool>("mapping/pool_stats_en", pool_stats_en, false);               // 每帧输出单帧点云缓冲池的分配统计
+    nh.param<int>("mapping/ikd_depth_stats_interval", ikd_depth_stats_interval, 100); // 每隔多少帧输出一次ikd-Tree深度直方图(0: 不输出)
+    nh.param<string>("mapping/map_backend", map_backend, "ikdtree");          // 局部地图后端: ikdtree 或 ivox(哈希体素地图)
+    nh.param<double>("mapping/ivox_resolution", ivox_resolution, 0.5);        // ivox体素大小，不是filter_size_map的整数倍时取最接近的整数倍
+    nh.param<int>("mapping/ivox_nearby_type", ivox_nearby_type, 19);          // ivox搜索近邻时查找的体素数: 7/19/27
+    nh.param<int>("mapping/ivox_capacity", ivox_capacity, 1000000);           // ivox最多保留的体素数(按区块LRU丢弃)
+    nh.param<double>("mapping/ivox_tile_size", ivox_tile_size, 50.0);         // ivox区块大小，局部地图移动时整块删除
+    nh.param<double>("mapping/undistort_tolerance", undistort_tolerance, 0.001); // 去畸变近似计算允许的最大误差(m)，<=0时逐点精确计算
+    nh.param<bool>("mapping/fuse_undistort_downsample", fuse_downsample_en, false); // 去畸变前先降采样，只补偿留下的点
     nh.param<bool>("pcd_save/pcd_save_en", pcd_save_en, false); // 是否将点云地图保存到PCD文件
     nh.param<int>("pcd_save/interval", pcd_save_interval, -1);
     nh.param<vector<double>>("mapping/extrinsic_T", extrinT, vector<double>()); // 雷达相对于IMU的外参T（即雷达在IMU坐标系中的坐标）
     nh.param<vector<double>>("mapping/extrinsic_R", extrinR, vector<double>()); // 雷达相对于IMU的外参R
 
     cout << "Lidar_type: " << p_pre->lidar_type << endl;
+    if (!state_layout_t::EXTRINSIC && extrinsic_est_en)
+    {
+        ROS_WARN("Built with STATE_DIM=%d, extrinsic is fixed, ignore mapping/extrinsic_est_en\n", STATE_DIM);
+        extrinsic_est_en = false;
+    }
     // 初始化path的header（包括时间戳和帧id），path用于保存odemetry的路径
     path.header.stamp = ros::Time::now();
     path.header.frame_id = "camera_init";
@@ -596,14 +715,53 @@ int main(int argc, char **argv)
     ros::Publisher pubOdomAftMapped = nh.advertise<nav_msgs::Odometry>("/Odometry", 100000);
     ros::Publisher pubPath = nh.advertise<nav_msgs::Path>("/path", 100000);
 
-    downSizeFilterSurf.setLeafSize(filter_size_surf_min, filter_size_surf_min, filter_size_surf_min);
+    downSizeFilterSurf.set_leaf_size(filter_size_surf_min);
     downSizeFilterMap.setLeafSize(filter_size_map_min, filter_size_map_min, filter_size_map_min);
 
+    kf.set_info_form_update(info_form_update_en);
+    kf.set_search_reuse(filter_size_map_min, search_reuse_ratio, iter_stop_epsi);
+    map_plane_cache.set_voxel_size(filter_size_map_min);
+    if (plane_cache_en)
+        kf.set_plane_cache(&map_plane_cache);
+
+    ikdtree.set_rebuild_thread_num(ikd_rebuild_threads);
+    ikdtree.set_multi_thread_rebuild_point_num(ikd_rebuild_point_num);
+    ikdtree.Set_delete_criterion_param(ikd_delete_param);
+    ikdtree.Set_balance_criterion_param(ikd_balance_param);
+    ikdtree.set_build_parallel_depth(ikd_build_parallel_depth);
+    if (map_backend == "ivox")
+    {
+        //ivox降采样只查找新点所在的体素，一个降采样体素跨两个ivox体素时重复的点会留下，因此取为filter_size_map的整数倍
+        double ivox_multiple = filter_size_map_min > 0 ? max(round(ivox_resolution / filter_size_map_min), 1.0) : 0;
+        if (ivox_multiple > 0 && fabs(ivox_multiple * filter_size_map_min - ivox_resolution) > 1e-6 * ivox_resolution)
+        {
+            ROS_WARN("mapping/ivox_resolution %f is not a multiple of filter_size_map %f, use %f\n", ivox_resolution,
+                     filter_size_map_min, ivox_multiple * filter_size_map_min);
+            ivox_resolution = ivox_multiple * filter_size_map_min;
+        }
+        ivox_map.set_param(ivox_resolution, ivox_nearby_type, ivox_capacity, ivox_tile_size);
+        map_ptr = &ivox_map;
+    }
+    else if (map_backend != "ikdtree")
+    {
+        ROS_WARN("Unknown mapping/map_backend \"%s\", use ikdtree\n", map_backend.c_str());
+    }
+    cout << "Map backend: " << map_ptr->name() << endl;
+
     shared_ptr<ImuProcess> p_imu1(new ImuProcess());
     Lidar_T_wrt_IMU << VEC_FROM_ARRAY(extrinT);
     Lidar_R_wrt_IMU << MAT_FROM_ARRAY(extrinR);
     p_imu1->set_param(Lidar_T_wrt_IMU, Lidar_R_wrt_IMU, V3D(gyr_cov, gyr_cov, gyr_cov), V3D(acc_cov, acc_cov, acc_cov),
                       V3D(b_gyr_cov, b_gyr_cov, b_gyr_cov), V3D(b_acc_cov, b_acc_cov, b_acc_cov));
+    p_imu1->set_undistort_tolerance(undistort_tolerance);
+    //发布稠密点云、机体系点云和保存PCD都要用整帧去畸变的点云，这时不能融合
+    if (fuse_downsample_en && (dense_pub_en || pcd_save_en || (scan_pub_en && scan_body_pub_en)))
+    {
+        ROS_WARN("fuse_undistort_downsample needs dense_publish_en, scan_bodyframe_pub_en and pcd_save_en off, disabled");
+        fuse_downsample_en = false;
+    }
+    if (fuse_downsample_en)
+        p_imu1->set_downsample_filter(&downSizeFilterSurf);
 
     signal(SIGINT, SigHandle); //当程序检测到signal信号（例如ctrl+c） 时  执行 SigHandle 函数
     ros::Rate rate(5000);
@@ -643,8 +801,17 @@ int main(int argc, char **argv)
             lasermap_fov_segment(); //更新localmap边界，然后降采样当前帧点云
 
             //点云下采样
-            downSizeFilterSurf.setInputCloud(feats_undistort);
-            downSizeFilterSurf.filter(*feats_down_body);
+            if (fuse_downsample_en)
+            {
+                *feats_down_body = *feats_undistort; //Process中已经降采样，feats_undistort只有留下的点
+                downsample_time = p_imu1->downsample_time;
+            }
+            else
+            {
+                double t_downsample = omp_get_wtime();
+                downSizeFilterSurf.filter(*feats_undistort, *feats_down_body);
+                downsample_time = omp_get_wtime() - t_downsample;
+            }
             feats_down_size = feats_down_body->points.size();
 
             // std::cout << "feats_down_size :" << feats_down_size << std::endl;
@@ -654,31 +821,32 @@ int main(int argc, char **argv)
                 continue;
             }
 
-            //初始化ikdtree(ikdtree为空时)
-            if (ikdtree.Root_Node == nullptr)
+            //初始化地图(地图为空时)
+            if (map_ptr->empty())
             {
-                ikdtree.set_downsample_param(filter_size_map_min);
+                map_ptr->set_downsample_size(filter_size_map_min);
                 feats_down_world->resize(feats_down_size);
+                MapPointVector init_points(feats_down_size);
                 for (int i = 0; i < feats_down_size; i++)
                 {
                     pointBodyToWorld(&(feats_down_body->points[i]), &(feats_down_world->points[i])); // lidar坐标系转到世界坐标系
+                    init_points[i] = to_map_point(feats_down_world->points[i]);
                 }
-                ikdtree.Build(feats_down_world->points); //根据世界坐标系下的点构建ikdtree
+                map_ptr->build(init_points); //根据世界坐标系下的点构建地图
                 continue;
             }
 
             if (0) // If you need to see map point, change to "if(1)"
             {
-                PointVector().swap(ikdtree.PCL_Storage);
-                ikdtree.flatten(ikdtree.Root_Node, ikdtree.PCL_Storage, NOT_RECORD);
-                featsFromMap->clear();
-                featsFromMap->points = ikdtree.PCL_Storage;
-                // std::cout << "ikdtree size: " << featsFromMap->points.size() << std::endl;
+                get_map_cloud(featsFromMap);
+                // std::cout << "map size: " << featsFromMap->points.size() << std::endl;
             }
 
             /*** iterated state estimation ***/
             Nearest_Points.resize(feats_down_size); //存储近邻点的vector
-            kf.update_iterated_dyn_share_modified(LASER_POINT_COV, feats_down_body, ikdtree, Nearest_Points, NUM_MAX_ITERATIONS, extrinsic_est_en);
+            double t_update = omp_get_wtime();
+            kf.update_iterated_dyn_share_modified(LASER_POINT_COV, feats_down_body, *map_ptr, Nearest_Points, NUM_MAX_ITERATIONS, extrinsic_est_en);
+            map_update_time = omp_get_wtime() - t_update;
 
             state_point = kf.get_x();
             pos_lid = state_point.pos + state_point.rot.matrix() * state_point.offset_T_L_I;
@@ -700,8 +868,29 @@ int main(int argc, char **argv)
             // publish_map(pubLaserCloudMap);
 
             double t11 = omp_get_wtime();
-            std::cout << "feats_down_size: " << feats_down_size << "  Whole mapping time(ms):  " << (t11 - t00) * 1000 << std::endl
-                      << std::endl;
+            std::cout << "feats_down_size: " << feats_down_size << "  Whole mapping time(ms):  " << (t11 - t00) * 1000 << std::endl;
+            if (scan_stats_en)
+            {
+                const esekfom::search_stats &search_st = kf.get_search_stats();
+                std::cout << "downsample(ms): " << downsample_time * 1000 << std::endl
+                          << "iterations: " << search_st.iterations << "  nearest searches: " << search_st.searched
+                          << "  skipped: " << search_st.skipped << "  early rejected: " << search_st.rejected << std::endl
+                          << "map(" << map_ptr->name() << ") size: " << map_ptr->size() << "  match+update(ms): " << map_update_time * 1000
+                          << "  incremental(ms): " << map_incremental_time * 1000 << std::endl;
+                if (!cub_needrm.empty())
+                    std::cout << "map moved, deleted points: " << kdtree_delete_counter << "  delete(ms): " << map_move_time * 1000 << std::endl;
+                if (plane_cache_en && search_st.plane_hits + search_st.plane_misses > 0)
+                {
+                    double avg_fit = search_st.plane_misses > 0 ? search_st.plane_fit_time / search_st.plane_misses : 0;
+                    std::cout << "plane cache hit rate: " << 100.0 * search_st.plane_hits / (search_st.plane_hits + search_st.plane_misses)
+                              << "%  est. saved(ms): " << search_st.plane_hits * avg_fit * 1000 << "  size: " << map_plane_cache.size() << std::endl;
+                }
+            }
+            if (ikd_stats_en && map_ptr == &ikd_map)
+                print_ikd_stats();
+            if (pool_stats_en)
+                print_pool_stats();
+            std::cout << std::endl;
         }
 
         rate.sleep();
@@ -729,16 +918,18 @@ int main(int argc, char **argv)
         pcd_writer.writeBinary(all_points_dir, *cloud);
 
         //////////////////////////////////////
-        PointVector().swap(ikdtree.PCL_Storage);
-        ikdtree.flatten(ikdtree.Root_Node, ikdtree.PCL_Storage, NOT_RECORD);
-        featsFromMap->clear();
-        featsFromMap->points = ikdtree.PCL_Storage;
-        std::cout << "ikdtree size: " << featsFromMap->points.size() << std::endl;
+        get_map_cloud(featsFromMap);
+        std::cout << "map size: " << featsFromMap->points.size() << std::endl;
         string file_name1 = string("GlobalMap_ikdtree.pcd");
         pcl::PCDWriter pcd_writer1;
         string all_points_dir1(string(string(ROOT_DIR) + "PCD/") + file_name1);
         cout << "current scan saved to /PCD/" << file_name1 << endl;
         pcd_writer1.writeBinary(all_points_dir1, *featsFromMap);
+
+        //使用ikdtree时同时保存二进制快照(保留树结构)，重定位时mmap直接加载
+        string all_points_dir2(string(string(ROOT_DIR) + "PCD/") + "GlobalMap_ikdtree.bin");
+        if (map_ptr == &ikd_map && ikdtree.save_snapshot(all_points_dir2))
+            cout << "ikdtree snapshot saved to /PCD/GlobalMap_ikdtree.bin" << endl;
     }
 
     return 0;
@@ -32,9 +32,15 @@
 /*** Time Log Variables ***/
 int add_point_size = 0, kdtree_delete_counter = 0;
 bool pcd_save_en = false, time_sync_en = false, extrinsic_est_en = true, path_en = true;
+bool info_form_update_en = true;
+double search_reuse_ratio = 0.1, iter_stop_epsi = 1e-4;
+bool plane_cache_en = false;
+bool scan_stats_en = false;
+int ikd_rebuild_threads = 2, ikd_rebuild_point_num = 1500, ikd_build_parallel_depth = 4;
+double ikd_delete_param = 0.5, ikd_balance_param = 0.6;
+plane_cache map_plane_cache; //按地图体素缓存拟合的平面
 /**************************/
 
-float res_last[100000] = {0.0};
 float DET_RANGE = 300.0f;
 const float MOV_THRESHOLD = 1.5f;
 double time_diff_lidar_to_imu = 0.0;
@@ -57,7 +63,7 @@ bool lidar_pushed, flg_first_scan = true, flg_exit = false, flg_EKF_inited;
 bool scan_pub_en = false, dense_pub_en = false, scan_body_pub_en = false;
 
 vector<BoxPointType> cub_needrm;
-vector<PointVector> Nearest_Points;
+vector<MapPointVector> Nearest_Points;
 vector<double> extrinT(3, 0.0);
 vector<double> extrinR(9, 0.0);
 vector<double> init_pos(3, 0.0);
@@ -75,7 +81,8 @@ PointCloudXYZI::Ptr cloud(new PointCloudXYZI());
 pcl::VoxelGrid<PointType> downSizeFilterSurf;
 pcl::VoxelGrid<PointType> downSizeFilterMap;
 
-KD_TREE<PointType> ikdtree;
+KD_TREE<MapPointType> ikdtree;
+ikd_tree_map ikd_map(ikdtree); //重定位使用预先建好的ikdtree地图
 
 V3D Lidar_T_wrt_IMU(Zero3d);
 M3D Lidar_R_wrt_IMU(Eye3d);
@@ -326,11 +333,15 @@ void lasermap_fov_segment()
     }
     LocalMap_Points = New_LocalMap_Points;
 
-    PointVector points_history;
+    MapPointVector points_history;
     ikdtree.acquire_removed_points(points_history);
 
     if (cub_needrm.size() > 0)
+    {
         kdtree_delete_counter = ikdtree.Delete_Point_Boxes(cub_needrm); //删除指定范围内的点
+        if (plane_cache_en)
+            map_plane_cache.invalidate(cub_needrm);
+    }
 }
 
 void RGBpointBodyLidarToIMU(PointType const *const pi, PointType *const po)
@@ -347,16 +358,37 @@ void RGBpointBodyLidarToIMU(PointType const *const pi, PointType *const po)
 //根据最新估计位姿  增量添加点云到map
 void init_ikdtree()
 {
-    //加载读取点云数据到cloud中
+    ikdtree.set_downsample_param(filter_size_map_min);
+
+    //优先mmap加载建图时保存的ikdtree二进制快照(不需要解析PCD和重新建树)，快照比PCD旧或不存在时再读取PCD建树
     string all_points_dir(string(string(ROOT_DIR) + "PCD/") + "GlobalMap_ikdtree.pcd");
+    string snapshot_dir(string(string(ROOT_DIR) + "PCD/") + "GlobalMap_ikdtree.bin");
+    struct stat pcd_st, snapshot_st;
+    bool pcd_exist = stat(all_points_dir.c_str(), &pcd_st) == 0;
+    bool snapshot_fresh = stat(snapshot_dir.c_str(), &snapshot_st) == 0 && (!pcd_exist || snapshot_st.st_mtime >= pcd_st.st_mtime);
+    if (snapshot_fresh && ikdtree.load_snapshot(snapshot_dir))
+    {
+        auto load_st = ikdtree.build_stats();
+        std::cout << "---- ikdtree size: " << ikdtree.size() << "  snapshot load time(s): " << load_st.time << std::endl;
+        return;
+    }
+
+    //加载读取点云数据到cloud中
     if (pcl::io::loadPCDFile<PointType>(all_points_dir, *cloud) == -1)
     {
         PCL_ERROR("Read file fail!\n");
     }
 
-    ikdtree.set_downsample_param(filter_size_map_min);
-    ikdtree.Build(cloud->points);
-    std::cout << "---- ikdtree size: " << ikdtree.size() << std::endl;
+    MapPointVector map_points(cloud->points.size());
+    for (size_t i = 0; i < cloud->points.size(); i++)
+        map_points[i] = to_map_point(cloud->points[i]);
+    ikdtree.Build(map_points);
+    auto build_st = ikdtree.build_stats();
+    std::cout << "---- ikdtree size: " << ikdtree.size() << "  build time(s): " << build_st.time
+              << "  throughput(Mpts/s): " << build_st.throughput / 1e6 << std::endl;
+    //保存快照，下次启动直接加载
+    if (ikdtree.size() > 0)
+        ikdtree.save_snapshot(snapshot_dir);
 }
 
 PointCloudXYZI::Ptr pcl_wait_pub(new PointCloudXYZI(500000, 1));
@@ -532,6 +564,16 @@ int main(int argc, char **argv)
     nh.param<int>("point_filter_num", p_pre->point_filter_num, 2);           // 采样间隔，即每隔point_filter_num个点取1个点
     nh.param<bool>("feature_extract_enable", p_pre->feature_enabled, false); // 是否提取特征点（FAST_LIO2默认不进行特征点提取）
     nh.param<bool>("mapping/extrinsic_est_en", extrinsic_est_en, true);
+    nh.param<bool>("mapping/info_form_update", info_form_update_en, true); // ESKF更新时是否使用信息形式(不构造m X 12的雅可比矩阵)
+    nh.param<double>("mapping/search_reuse_ratio", search_reuse_ratio, 0.1); // 点的位移小于 search_reuse_ratio*filter_size_map 时复用上次的近邻
+    nh.param<double>("mapping/iter_stop_epsi", iter_stop_epsi, 1e-4);        // 状态增量小于该值时提前结束ESKF迭代
+    nh.param<bool>("mapping/plane_cache_en", plane_cache_en, false);         // 是否按地图体素缓存拟合的平面
+    nh.param<bool>("mapping/scan_stats_en", scan_stats_en, false);           // 每帧输出近邻搜索和平面缓存的统计
+    nh.param<int>("mapping/ikd_rebuild_threads", ikd_rebuild_threads, 2);     // ikd-Tree后台重建子树的线程数
+    nh.param<int>("mapping/ikd_rebuild_point_num", ikd_rebuild_point_num, 1500); // 子树点数不少于该值时交给后台线程重建
+    nh.param<double>("mapping/ikd_delete_param", ikd_delete_param, 0.5);    // ikd-Tree删除点比例超过该值时重建
+    nh.param<double>("mapping/ikd_balance_param", ikd_balance_param, 0.6);  // ikd-Tree平衡判据
+    nh.param<int>("mapping/ikd_build_parallel_depth", ikd_build_parallel_depth, 4); // ikd-Tree整体构建时前几层子树并行构建
     nh.param<bool>("pcd_save/pcd_save_en", pcd_save_en, false); // 是否将点云地图保存到PCD文件
     nh.param<vector<double>>("mapping/extrinsic_T", extrinT, vector<double>()); // 雷达相对于IMU的外参T（即雷达在IMU坐标系中的坐标）
     nh.param<vector<double>>("mapping/extrinsic_R", extrinR, vector<double>()); // 雷达相对于IMU的外参R
@@ -540,6 +582,11 @@ int main(int argc, char **argv)
     nh.param<vector<double>>("mapping/init_rot", init_rot, vector<double>()); // 雷达相对于IMU的外参R
 
     cout << "Lidar_type: " << p_pre->lidar_type << endl;
+    if (!state_layout_t::EXTRINSIC && extrinsic_est_en)
+    {
+        ROS_WARN("Built with STATE_DIM=%d, extrinsic is fixed, ignore mapping/extrinsic_est_en\n", STATE_DIM);
+        extrinsic_est_en = false;
+    }
     // 初始化path的header（包括时间戳和帧id），path用于保存odemetry的路径
     path.header.stamp = ros::Time::now();
     path.header.frame_id = "camera_init";
@@ -557,6 +604,18 @@ int main(int argc, char **argv)
     downSizeFilterSurf.setLeafSize(filter_size_surf_min, filter_size_surf_min, filter_size_surf_min);
     downSizeFilterMap.setLeafSize(filter_size_map_min, filter_size_map_min, filter_size_map_min);
 
+    kf.set_info_form_update(info_form_update_en);
+    kf.set_search_reuse(filter_size_map_min, search_reuse_ratio, iter_stop_epsi);
+    map_plane_cache.set_voxel_size(filter_size_map_min);
+    if (plane_cache_en)
+        kf.set_plane_cache(&map_plane_cache);
+
+    ikdtree.set_rebuild_thread_num(ikd_rebuild_threads);
+    ikdtree.set_multi_thread_rebuild_point_num(ikd_rebuild_point_num);
+    ikdtree.Set_delete_criterion_param(ikd_delete_param);
+    ikdtree.Set_balance_criterion_param(ikd_balance_param);
+    ikdtree.set_build_parallel_depth(ikd_build_parallel_depth);
+
     shared_ptr<ImuProcess> p_imu1(new ImuProcess());
     Lidar_T_wrt_IMU << VEC_FROM_ARRAY(extrinT);
     Lidar_R_wrt_IMU << MAT_FROM_ARRAY(extrinR);
@@ -636,16 +695,17 @@ int main(int argc, char **argv)
 
             if (0) // If you need to see map point, change to "if(1)"
             {
-                PointVector().swap(ikdtree.PCL_Storage);
+                MapPointVector().swap(ikdtree.PCL_Storage);
                 ikdtree.flatten(ikdtree.Root_Node, ikdtree.PCL_Storage, NOT_RECORD);
                 featsFromMap->clear();
-                featsFromMap->points = ikdtree.PCL_Storage;
+                for (const MapPointType &p : ikdtree.PCL_Storage)
+                    featsFromMap->points.push_back(from_map_point(p));
                 std::cout << "ikdtree size: " << featsFromMap->points.size() << std::endl;
             }
 
             /*** iterated state estimation ***/
             Nearest_Points.resize(feats_down_size); //存储近邻点的vector
-            kf.update_iterated_dyn_share_modified(LASER_POINT_COV, feats_down_body, ikdtree, Nearest_Points, NUM_MAX_ITERATIONS, extrinsic_est_en);
+            kf.update_iterated_dyn_share_modified(LASER_POINT_COV, feats_down_body, ikd_map, Nearest_Points, NUM_MAX_ITERATIONS, extrinsic_est_en);
 
             state_point = kf.get_x();
             pos_lid = state_point.pos + state_point.rot.matrix() * state_point.offset_T_L_I;
@@ -666,8 +726,20 @@ int main(int argc, char **argv)
                 publish_frame_body(pubLaserCloudFull_body);
 
             double t11 = omp_get_wtime();
-            std::cout << "feats_down_size: " << feats_down_size << "  Whole mapping time(ms):  " << (t11 - t00) * 1000 << std::endl
-                      << std::endl;
+            std::cout << "feats_down_size: " << feats_down_size << "  Whole mapping time(ms):  " << (t11 - t00) * 1000 << std::endl;
+            if (scan_stats_en)
+            {
+                const esekfom::search_stats &search_st = kf.get_search_stats();
+                std::cout << "iterations: " << search_st.iterations << "  nearest searches: " << search_st.searched
+                          << "  skipped: " << search_st.skipped << std::endl;
+                if (plane_cache_en && search_st.plane_hits + search_st.plane_misses > 0)
+                {
+                    double avg_fit = search_st.plane_misses > 0 ? search_st.plane_fit_time / search_st.plane_misses : 0;
+                    std::cout << "plane cache hit rate: " << 100.0 * search_st.plane_hits / (search_st.plane_hits + search_st.plane_misses)
+                              << "%  est. saved(ms): " << search_st.plane_hits * avg_fit * 1000 << "  size: " << map_plane_cache.size() << std::endl;
+                }
+            }
+            std::cout << std::endl;
         }
 
         rate.sleep();
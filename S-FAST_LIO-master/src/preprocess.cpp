@@ -24,6 +24,7 @@ Preprocess::Preprocess()
   smallp_intersect = 172.5;
   smallp_ratio = 1.2;
   given_offset_time = false;
+  time_ordered = false;
 
   jump_up_limit = cos(jump_up_limit / 180 * M_PI);
   jump_down_limit = cos(jump_down_limit / 180 * M_PI);
@@ -41,10 +42,51 @@ void Preprocess::set(bool feat_en, int lid_type, double bld, int pfilt_num)
   point_filter_num = pfilt_num;
 }
 
+bool cloud_layout::matches(const sensor_msgs::PointCloud2 &msg) const
+{
+  if (msg.point_step != point_step || msg.fields.size() != signature.size())
+    return false;
+  for (size_t i = 0; i < signature.size(); i++)
+  {
+    if (msg.fields[i].offset != signature[i].first || msg.fields[i].datatype != signature[i].second)
+      return false;
+  }
+  return true;
+}
+
+void cloud_layout::resolve(const sensor_msgs::PointCloud2 &msg, const char *time_name)
+{
+  point_step = msg.point_step;
+  signature.clear();
+  x = y = z = intensity = time = ring = cloud_field();
+  for (const sensor_msgs::PointField &f : msg.fields)
+  {
+    signature.push_back(make_pair(f.offset, f.datatype));
+    cloud_field field;
+    field.offset = f.offset;
+    field.datatype = f.datatype;
+    if (f.name == "x")
+      x = field;
+    else if (f.name == "y")
+      y = field;
+    else if (f.name == "z")
+      z = field;
+    else if (f.name == "intensity")
+      intensity = field;
+    else if (f.name == time_name)
+      time = field;
+    else if (f.name == "ring")
+      ring = field;
+  }
+  if (x.offset < 0 || y.offset < 0 || z.offset < 0)
+    ROS_WARN("PointCloud2 without x/y/z fields, the points will read as 0");
+}
+
 void Preprocess::process(const livox_ros_driver::CustomMsg::ConstPtr &msg, PointCloudXYZI::Ptr &pcl_out)
 {
   avia_handler(msg);
-  *pcl_out = pl_surf;
+  time_ordered = is_time_ordered(pl_surf);
+  pcl_out->swap(pl_surf); // hand the points over without copying, pl_surf keeps pcl_out's old buffer for the next scan
 }
 
 void Preprocess::process(const sensor_msgs::PointCloud2::ConstPtr &msg, PointCloudXYZI::Ptr &pcl_out)
@@ -86,7 +128,16 @@ void Preprocess::process(const sensor_msgs::PointCloud2::ConstPtr &msg, PointClo
     printf("Error LiDAR Type");
     break;
   }
-  *pcl_out = pl_surf;
+  time_ordered = is_time_ordered(pl_surf);
+  pcl_out->swap(pl_surf); // hand the points over without copying, pl_surf keeps pcl_out's old buffer for the next scan
+}
+
+bool Preprocess::is_time_ordered(const PointCloudXYZI &pl)
+{
+  for (size_t i = 1; i < pl.points.size(); i++)
+    if (pl.points[i].curvature < pl.points[i - 1].curvature)
+      return false;
+  return true;
 }
 
 void Preprocess::avia_handler(const livox_ros_driver::CustomMsg::ConstPtr &msg)
@@ -188,13 +239,13 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
   pl_surf.clear();
   pl_corn.clear();
   pl_full.clear();
-  pcl::PointCloud<ouster_ros::Point> pl_orig;
-  pcl::fromROSMsg(*msg, pl_orig);
-  int plsize = pl_orig.size();
+  if (!layout.matches(*msg))
+    layout.resolve(*msg, "t");
+  int plsize = msg->width * msg->height;
   pl_corn.reserve(plsize);
-  pl_surf.reserve(plsize);
   if (feature_enabled)
   {
+    pl_surf.reserve(plsize);
     for (int i = 0; i < N_SCANS; i++)
     {
       pl_buff[i].clear();
@@ -203,28 +254,23 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
 
     for (uint i = 0; i < plsize; i++)
     {
-      double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y + pl_orig.points[i].z * pl_orig.points[i].z;
+      const uint8_t *pt = layout.point(*msg, i);
+      PointType added_pt;
+      added_pt.x = layout.read(pt, layout.x);
+      added_pt.y = layout.read(pt, layout.y);
+      added_pt.z = layout.read(pt, layout.z);
+      double range = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
       if (range < (blind * blind))
         continue;
-      Eigen::Vector3d pt_vec;
-      PointType added_pt;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
+      added_pt.intensity = layout.read(pt, layout.intensity);
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
-      double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.3;
-      if (yaw_angle >= 180.0)
-        yaw_angle -= 360.0;
-      if (yaw_angle <= -180.0)
-        yaw_angle += 360.0;
-
-      added_pt.curvature = pl_orig.points[i].t * time_unit_scale;
-      if (pl_orig.points[i].ring < N_SCANS)
+      added_pt.curvature = float(layout.read(pt, layout.time)) * time_unit_scale;
+      int ring = layout.read(pt, layout.ring);
+      if (ring < N_SCANS)
       {
-        pl_buff[pl_orig.points[i].ring].push_back(added_pt);
+        pl_buff[ring].push_back(added_pt);
       }
     }
 
@@ -250,29 +296,25 @@ void Preprocess::oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
   }
   else
   {
-    double time_stamp = msg->header.stamp.toSec();
-    // cout << "===================================" << endl;
-    // printf("Pt size = %d, N_SCANS = %d\r\n", plsize, N_SCANS);
-    for (int i = 0; i < pl_orig.points.size(); i++)
+    // Decimation and the blind-zone check are fused into the single pass over msg->data
+    pl_surf.reserve(plsize / point_filter_num + 1);
+    for (int i = 0; i < plsize; i += point_filter_num)
     {
-      if (i % point_filter_num != 0)
-        continue;
-
-      double range = pl_orig.points[i].x * pl_orig.points[i].x + pl_orig.points[i].y * pl_orig.points[i].y + pl_orig.points[i].z * pl_orig.points[i].z;
+      const uint8_t *pt = layout.point(*msg, i);
+      PointType added_pt;
+      added_pt.x = layout.read(pt, layout.x);
+      added_pt.y = layout.read(pt, layout.y);
+      added_pt.z = layout.read(pt, layout.z);
+      double range = added_pt.x * added_pt.x + added_pt.y * added_pt.y + added_pt.z * added_pt.z;
 
       if (range < (blind * blind))
         continue;
 
-      Eigen::Vector3d pt_vec;
-      PointType added_pt;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
+      added_pt.intensity = layout.read(pt, layout.intensity);
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
-      added_pt.curvature = pl_orig.points[i].t * time_unit_scale; // curvature unit: ms
+      added_pt.curvature = float(layout.read(pt, layout.time)) * time_unit_scale; // curvature unit: ms
 
       pl_surf.points.push_back(added_pt);
     }
@@ -287,12 +329,11 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
   pl_corn.clear();
   pl_full.clear();
 
-  pcl::PointCloud<velodyne_ros::Point> pl_orig;
-  pcl::fromROSMsg(*msg, pl_orig);
-  int plsize = pl_orig.points.size();
+  if (!layout.matches(*msg))
+    layout.resolve(*msg, "time");
+  int plsize = msg->width * msg->height;
   if (plsize == 0)
     return;
-  pl_surf.reserve(plsize);
 
   /*** These variables only works when no point timestamps given ***/
   double omega_l = 0.361 * SCAN_RATE; // scan angular velocity
@@ -302,28 +343,11 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
   std::vector<float> time_last(N_SCANS, 0.0); // last offset time
   /*****************************************************************/
 
-  if (pl_orig.points[plsize - 1].time > 0)
-  {
-    given_offset_time = true;
-  }
-  else
-  {
-    given_offset_time = false;
-    double yaw_first = atan2(pl_orig.points[0].y, pl_orig.points[0].x) * 57.29578;
-    double yaw_end = yaw_first;
-    int layer_first = pl_orig.points[0].ring;
-    for (uint i = plsize - 1; i > 0; i--)
-    {
-      if (pl_orig.points[i].ring == layer_first)
-      {
-        yaw_end = atan2(pl_orig.points[i].y, pl_orig.points[i].x) * 57.29578;
-        break;
-      }
-    }
-  }
+  given_offset_time = layout.read(layout.point(*msg, plsize - 1), layout.time) > 0;
 
   if (feature_enabled)
   {
+    pl_surf.reserve(plsize);
     for (int i = 0; i < N_SCANS; i++)
     {
       pl_buff[i].clear();
@@ -332,18 +356,19 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
 
     for (int i = 0; i < plsize; i++)
     {
+      const uint8_t *pt = layout.point(*msg, i);
       PointType added_pt;
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
-      int layer = pl_orig.points[i].ring;
+      int layer = layout.read(pt, layout.ring);
       if (layer >= N_SCANS)
         continue;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
-      added_pt.curvature = pl_orig.points[i].time * time_unit_scale; // units: ms
+      added_pt.x = layout.read(pt, layout.x);
+      added_pt.y = layout.read(pt, layout.y);
+      added_pt.z = layout.read(pt, layout.z);
+      added_pt.intensity = layout.read(pt, layout.intensity);
+      added_pt.curvature = float(layout.read(pt, layout.time)) * time_unit_scale; // units: ms
 
       if (!given_offset_time)
       {
@@ -402,25 +427,27 @@ void Preprocess::velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg)
   }
   else
   {
+    pl_surf.reserve(plsize / point_filter_num + 1);
     for (int i = 0; i < plsize; i++)
     {
+      // With per-point times the yaw bookkeeping is not needed, so decimated points are skipped before reading them
+      if (given_offset_time && i % point_filter_num != 0)
+        continue;
+      const uint8_t *pt = layout.point(*msg, i);
       PointType added_pt;
-      // cout<<"!!!!!!"<<i<<" "<<plsize<<endl;
 
       added_pt.normal_x = 0;
       added_pt.normal_y = 0;
       added_pt.normal_z = 0;
-      added_pt.x = pl_orig.points[i].x;
-      added_pt.y = pl_orig.points[i].y;
-      added_pt.z = pl_orig.points[i].z;
-      added_pt.intensity = pl_orig.points[i].intensity;
-      added_pt.curvature = pl_orig.points[i].time * time_unit_scale; // curvature unit: ms // cout<<added_pt.curvature<<endl;
-      // std::cout << "added_pt.curvature:" << added_pt.curvature << std::endl;
-
+      added_pt.x = layout.read(pt, layout.x);
+      added_pt.y = layout.read(pt, layout.y);
+      added_pt.z = layout.read(pt, layout.z);
+      added_pt.intensity = layout.read(pt, layout.intensity);
+      added_pt.curvature = float(layout.read(pt, layout.time)) * time_unit_scale; // curvature unit: ms
 
       if (!given_offset_time)
       {
-        int layer = pl_orig.points[i].ring;
+        int layer = layout.read(pt, layout.ring);
         double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
 
         if (is_first[layer])
@@ -943,10 +970,13 @@ void Preprocess::rs_handler(const sensor_msgs::PointCloud2_<allocator<void>>::Co
 {
   pl_surf.clear();
 
-  pcl::PointCloud<rslidar_ros::Point> pl_orig;
-  pcl::fromROSMsg(*msg, pl_orig);
-  int plsize = pl_orig.points.size();
-  pl_surf.reserve(plsize);
+  // 直接按字段偏移读取msg->data，不再先用pcl::fromROSMsg转换成中间点云
+  if (!layout.matches(*msg))
+    layout.resolve(*msg, "timestamp");
+  int plsize = msg->width * msg->height;
+  if (plsize == 0)
+    return;
+  pl_surf.reserve(plsize / point_filter_num + 1);
 
   /*** These variables only works when no point timestamps given ***/
   double omega_l = 0.361 * SCAN_RATE; // scan angular velocity
@@ -956,44 +986,29 @@ void Preprocess::rs_handler(const sensor_msgs::PointCloud2_<allocator<void>>::Co
   std::vector<float> time_last(N_SCANS, 0.0); // last offset time
   /*****************************************************************/
 
-  if (pl_orig.points[plsize - 1].timestamp > 0) // todo check pl_orig.points[plsize - 1].time
-  {
-    given_offset_time = true;
-    // std::cout << "given_offset_time = true " << std::endl;
-  }
-  else
-  {
-    given_offset_time = false;
-    double yaw_first = atan2(pl_orig.points[0].y, pl_orig.points[0].x) * 57.29578; // 记录第一个点(index 0)的yaw， to degree
-    double yaw_end = yaw_first;
-    int layer_first = pl_orig.points[0].ring; // 第一个点(index 0)的layer序号
-    for (uint i = plsize - 1; i > 0; i--)     // 倒序遍历，找到与第一个点相同layer的最后一个点
-    {
-      if (pl_orig.points[i].ring == layer_first)
-      {
-        yaw_end = atan2(pl_orig.points[i].y, pl_orig.points[i].x) * 57.29578; // 与第一个点相同layer的最后一个点的yaw
-        break;
-      }
-    }
-  }
+  double timestamp_first = layout.read(layout.point(*msg, 0), layout.time); // 第一个点的时间戳
+  given_offset_time = layout.read(layout.point(*msg, plsize - 1), layout.time) > 0;
 
   for (int i = 0; i < plsize; i++)
   {
+    // 有逐点时间戳时不需要按yaw推算时间，被抽稀掉的点直接跳过，不读取
+    if (given_offset_time && i % point_filter_num != 0)
+      continue;
+    const uint8_t *pt = layout.point(*msg, i);
     PointType added_pt;
 
     added_pt.normal_x = 0;
     added_pt.normal_y = 0;
     added_pt.normal_z = 0;
-    added_pt.x = pl_orig.points[i].x;
-    added_pt.y = pl_orig.points[i].y;
-    added_pt.z = pl_orig.points[i].z;
-    added_pt.intensity = pl_orig.points[i].intensity;
-    added_pt.curvature = (pl_orig.points[i].timestamp - pl_orig.points[0].timestamp) * 1000.0; // curvature unit: ms
-    // std::cout << "added_pt.curvature:" << added_pt.curvature << std::endl;
+    added_pt.x = layout.read(pt, layout.x);
+    added_pt.y = layout.read(pt, layout.y);
+    added_pt.z = layout.read(pt, layout.z);
+    added_pt.intensity = layout.read(pt, layout.intensity);
+    added_pt.curvature = (layout.read(pt, layout.time) - timestamp_first) * 1000.0; // curvature unit: ms
 
     if (!given_offset_time)
     {
-      int layer = pl_orig.points[i].ring;
+      int layer = layout.read(pt, layout.ring);
       double yaw_angle = atan2(added_pt.y, added_pt.x) * 57.2957;
 
       if (is_first[layer])
@@ -1,6 +1,7 @@
 #include <ros/ros.h>
 #include <pcl_conversions/pcl_conversions.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <cstring>
 #include <livox_ros_driver/CustomMsg.h>
 
 using namespace std;
@@ -123,6 +124,51 @@ POINT_CLOUD_REGISTER_POINT_STRUCT(ouster_ros::Point,
     (std::uint32_t, range, range)
 )
 
+// Where a handler finds one field inside sensor_msgs::PointCloud2::data
+struct cloud_field
+{
+  int offset = -1; // -1: not in the message, reads as 0
+  uint8_t datatype = 0;
+};
+
+// Field layout of a PointCloud2 topic, resolved from msg->fields once and reused while the layout stays the
+// same, so the handlers read the points in place instead of converting the message with pcl::fromROSMsg first.
+struct cloud_layout
+{
+  cloud_field x, y, z, intensity, time, ring;
+  uint32_t point_step = 0;
+  vector<pair<uint32_t, uint8_t>> signature; // offset and datatype of every field in msg->fields
+
+  bool matches(const sensor_msgs::PointCloud2 &msg) const;
+  void resolve(const sensor_msgs::PointCloud2 &msg, const char *time_name);
+
+  static const uint8_t *point(const sensor_msgs::PointCloud2 &msg, int i)
+  {
+    if (msg.height <= 1 || msg.row_step == msg.width * msg.point_step)
+      return &msg.data[size_t(i) * msg.point_step];
+    return &msg.data[size_t(i / msg.width) * msg.row_step + size_t(i % msg.width) * msg.point_step];
+  }
+
+  static double read(const uint8_t *pt, const cloud_field &f)
+  {
+    if (f.offset < 0)
+      return 0;
+    pt += f.offset;
+    switch (f.datatype)
+    {
+    case sensor_msgs::PointField::FLOAT32: { float v; memcpy(&v, pt, sizeof(v)); return v; }
+    case sensor_msgs::PointField::FLOAT64: { double v; memcpy(&v, pt, sizeof(v)); return v; }
+    case sensor_msgs::PointField::UINT8: return *pt;
+    case sensor_msgs::PointField::INT8: return int8_t(*pt);
+    case sensor_msgs::PointField::UINT16: { uint16_t v; memcpy(&v, pt, sizeof(v)); return v; }
+    case sensor_msgs::PointField::INT16: { int16_t v; memcpy(&v, pt, sizeof(v)); return v; }
+    case sensor_msgs::PointField::UINT32: { uint32_t v; memcpy(&v, pt, sizeof(v)); return v; }
+    case sensor_msgs::PointField::INT32: { int32_t v; memcpy(&v, pt, sizeof(v)); return v; }
+    default: return 0;
+    }
+  }
+};
+
 class Preprocess
 {
   public:
@@ -143,6 +189,7 @@ class Preprocess
   int lidar_type, point_filter_num, N_SCANS, SCAN_RATE, time_unit;
   double blind;
   bool feature_enabled, given_offset_time;
+  bool time_ordered; // the last output is sorted by curvature (time), so UndistortPcl can skip its sort
   ros::Publisher pub_full, pub_surf, pub_corn;
     
 
@@ -152,10 +199,13 @@ class Preprocess
   void oust64_handler(const sensor_msgs::PointCloud2::ConstPtr &msg);
   void velodyne_handler(const sensor_msgs::PointCloud2::ConstPtr &msg);
   void give_feature(PointCloudXYZI &pl, vector<orgtype> &types);
+  static bool is_time_ordered(const PointCloudXYZI &pl);
   void pub_func(PointCloudXYZI &pl, const ros::Time &ct);
   int  plane_judge(const PointCloudXYZI &pl, vector<orgtype> &types, uint i, uint &i_nex, Eigen::Vector3d &curr_direct);
   bool small_plane(const PointCloudXYZI &pl, vector<orgtype> &types, uint i_cur, uint &i_nex, Eigen::Vector3d &curr_direct);
   bool edge_jump_judge(const PointCloudXYZI &pl, vector<orgtype> &types, uint i, Surround nor_dir);
+
+  cloud_layout layout;
   
   int group_size;
   double disA, disB, inf_bound;
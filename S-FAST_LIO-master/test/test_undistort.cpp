@@ -0,0 +1,207 @@
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "IMU_Processing.hpp"
+
+//用合成的IMU和点云驱动UndistortPcl，与原来逐点、按时间倒序计算的去畸变公式比较
+class ImuProcessTest : public ::testing::Test
+{
+ protected:
+  struct result
+  {
+    double max_dev = 0;     //与原公式的最大偏差(m)
+    double max_excess = 0;  //偏差超过该点 theta^3/6*r 的最大值(m)
+    size_t differ = 0;      //与原公式不完全相同的点数
+    size_t points = 0;
+  };
+
+  void SetUp() override
+  {
+    state_ikfom st = kf_.get_x();
+    st.offset_T_L_I = V3D(0.05, -0.02, 0.1);
+    st.offset_R_L_I = Sophus::SO3(Eigen::AngleAxisd(0.1, V3D(0, 0, 1)).toRotationMatrix());
+    st.vel = V3D(5, 0.5, 0);
+    st.grav = V3D(0, 0, -9.81);
+    kf_.change_x(st);
+
+    imu_.imu_need_init_ = false;
+    imu_.mean_acc = V3D(0, 0, 1);
+    imu_.last_lidar_end_time_ = 0;
+  }
+
+  sensor_msgs::ImuConstPtr imu_msg(double t, double wz) const
+  {
+    sensor_msgs::Imu::Ptr msg(new sensor_msgs::Imu());
+    msg->header.stamp = ros::Time().fromSec(t);
+    msg->angular_velocity.x = 0.3 * sin(5 * t);
+    msg->angular_velocity.y = -0.2;
+    msg->angular_velocity.z = wz;
+    msg->linear_acceleration.x = 0.5;
+    msg->linear_acceleration.z = 9.81;
+    return msg;
+  }
+
+  //10Hz的扫描，200Hz的IMU，点按时间排好，距离3~80m
+  void make_scan(int s, double wz, MeasureGroup &meas)
+  {
+    std::uniform_real_distribution<float> u(-1, 1);
+    meas.lidar_beg_time = s * 0.1;
+    meas.lidar_end_time = s * 0.1 + 0.1;
+    meas.lidar_time_ordered = true;
+    for (int i = 1; i <= 20; i++)
+      meas.imu.push_back(imu_msg(s * 0.1 + i * 0.005, wz));
+    const int n = 20000;
+    meas.lidar->points.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+      PointType &p = meas.lidar->points[i];
+      float r = 3 + 77 * (u(rng_) * 0.5f + 0.5f);
+      float a = u(rng_) * 3.14f;
+      p.x = r * cos(a);
+      p.y = r * sin(a);
+      p.z = u(rng_) * 5;
+      p.curvature = 100.0f * i / n;
+    }
+  }
+
+  //原来的反向传播去畸变(逐点Sophus::SO3::exp)，同时求每个点二阶展开的误差上界
+  void reference(PointCloudXYZI &pcl, vector<double> &bound)
+  {
+    const state_ikfom imu_state = kf_.get_x();
+    const vector<Pose6D> &IMUpose = imu_.IMUpose;
+    M3D R_imu;
+    V3D acc_imu, vel_imu, pos_imu, angvel_avr;
+    bound.assign(pcl.points.size(), 0);
+    auto it_pcl = pcl.points.end() - 1;
+    for (auto it_kp = IMUpose.end() - 1; it_kp != IMUpose.begin(); it_kp--)
+    {
+      auto head = it_kp - 1;
+      auto tail = it_kp;
+      R_imu<<MAT_FROM_ARRAY(head->rot);
+      vel_imu<<VEC_FROM_ARRAY(head->vel);
+      pos_imu<<VEC_FROM_ARRAY(head->pos);
+      acc_imu<<VEC_FROM_ARRAY(tail->acc);
+      angvel_avr<<VEC_FROM_ARRAY(tail->gyr);
+
+      for(; it_pcl->curvature / double(1000) > head->offset_time; it_pcl --)
+      {
+        double dt = it_pcl->curvature / double(1000) - head->offset_time;
+
+        M3D R_i(R_imu * Sophus::SO3::exp(angvel_avr * dt).matrix() );
+        V3D P_i(it_pcl->x, it_pcl->y, it_pcl->z);
+        V3D T_ei(pos_imu + vel_imu * dt + 0.5 * acc_imu * dt * dt - imu_state.pos);
+        V3D P_compensate = imu_state.offset_R_L_I.matrix().transpose() * (imu_state.rot.matrix().transpose() * (R_i * (imu_state.offset_R_L_I.matrix() * P_i + imu_state.offset_T_L_I) + T_ei) - imu_state.offset_T_L_I);
+
+        double theta = angvel_avr.norm() * dt;
+        bound[it_pcl - pcl.points.begin()] = theta * theta * theta / 6.0 * (P_i.norm() + imu_state.offset_T_L_I.norm());
+
+        it_pcl->x = P_compensate(0);
+        it_pcl->y = P_compensate(1);
+        it_pcl->z = P_compensate(2);
+
+        if (it_pcl == pcl.points.begin()) break;
+      }
+    }
+  }
+
+  //leaf > 0 时去畸变前先降采样，参考结果对同样降采样后的原始点逐点计算
+  result run(double tol, double wz, int scans = 3, float leaf = 0)
+  {
+    result res;
+    voxel_filter down, down_ref;
+    down.set_leaf_size(leaf);
+    down_ref.set_leaf_size(leaf);
+    imu_.set_undistort_tolerance(tol);
+    imu_.set_downsample_filter(leaf > 0 ? &down : nullptr);
+    imu_.last_imu_ = imu_msg(0, wz);
+    for (int s = 0; s < scans; s++)
+    {
+      MeasureGroup meas;
+      make_scan(s, wz, meas);
+      PointCloudXYZI out, ref;
+      if (leaf > 0)
+        down_ref.filter(*meas.lidar, ref);
+      else
+        ref = *meas.lidar;
+      imu_.UndistortPcl(meas, kf_, out);
+      vector<double> bound;
+      reference(ref, bound);
+
+      EXPECT_EQ(out.points.size(), ref.points.size());
+      for (size_t i = 0; i < out.points.size() && i < ref.points.size(); i++)
+      {
+        const PointType &p = out.points[i], &q = ref.points[i];
+        const float pv[3] = {p.x, p.y, p.z}, qv[3] = {q.x, q.y, q.z};
+        if (memcmp(pv, qv, sizeof(pv)) != 0)
+          res.differ++;
+        double dev = sqrt(pow(p.x - q.x, 2) + pow(p.y - q.y, 2) + pow(p.z - q.z, 2));
+        res.max_dev = max(res.max_dev, dev);
+        res.max_excess = max(res.max_excess, dev - bound[i]);
+      }
+      res.points += out.points.size();
+    }
+    return res;
+  }
+
+  ImuProcess imu_;
+  esekfom::esekf kf_;
+  std::mt19937 rng_{7};
+};
+
+//float计算本身的舍入误差(80m处约1e-5m)
+static const double kFloatSlack = 1e-4;
+
+TEST_F(ImuProcessTest, ZeroToleranceIsBitIdentical)
+{
+  result res = run(0, 1.5);
+  EXPECT_GT(res.points, 0u);
+  EXPECT_EQ(res.differ, 0u);
+}
+
+TEST_F(ImuProcessTest, FastPathWithinToleranceModerateYaw)
+{
+  result res = run(0.001, 1.5);
+  EXPECT_GT(res.differ, 0u);  //确实走了近似计算
+  EXPECT_LT(res.max_dev, 0.001);
+}
+
+TEST_F(ImuProcessTest, FastPathWithinToleranceFastYaw)
+{
+  result res = run(0.001, 6);
+  EXPECT_GT(res.differ, 0u);
+  EXPECT_LT(res.max_dev, 0.001);
+}
+
+//放宽tolerance让20rad/s的区间也走二阶展开，截断误差远大于float舍入，应被 theta^3/6*r 界住
+TEST_F(ImuProcessTest, FastPathErrorBoundedByRotationRemainder)
+{
+  result res = run(0.05, 20);
+  EXPECT_GT(res.max_dev, 1e-3);
+  EXPECT_LT(res.max_dev, 0.05);
+  EXPECT_LT(res.max_excess, kFloatSlack);
+}
+
+//theta^3/6*r_max 超过tolerance的区间必须退回原公式
+TEST_F(ImuProcessTest, FallsBackWhenBoundExceedsTolerance)
+{
+  result res = run(0.001, 20);
+  EXPECT_EQ(res.differ, 0u);
+}
+
+//融合降采样：只补偿体素中留下的点，结果与先降采样再逐点去畸变相同
+TEST_F(ImuProcessTest, FusedDownsampleUndistortsKeptPoints)
+{
+  result res = run(0, 1.5, 3, 4.0f);
+  EXPECT_GT(res.points, 0u);
+  EXPECT_LT(res.points, 3u * 20000 / 2);
+  EXPECT_EQ(res.differ, 0u);
+}
+
+int main(int argc, char **argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}